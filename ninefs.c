@@ -13,12 +13,18 @@
  *  - support attach name as an argument
  */
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
+#include <psapi.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
 #include "npfs.h"
 #include "npclient.h"
 #include "npauth.h"
@@ -26,10 +32,19 @@
 
 #define ARRSZ(a)    (sizeof(a) / sizeof((a)[0]))
 
+// Older CRTs lack the POSIX socket errnos npclient reports.
+#ifndef ECONNRESET
+#define ECONNRESET      108
+#define ECONNABORTED    106
+#define ENOTCONN        126
+#define ETIMEDOUT       138
+#endif
+#define DEFIOUNIT   (8192 - IOHDRSZ)
+
 static Npuser *user = NULL;
-static Npcfsys *fs = NULL;
 static int debug = 0;
 static int transPath = 1;
+static u32 maxmsg = 0;
 
 static int optind = 1;
 static int optpos = 0;
@@ -175,6 +190,452 @@ winpath(char *s)
     return fn;
 }
 
+// The connection.  If it drops, a new one is made and becomes
+// current; the old one is kept, unmounted, until the last fid opened
+// on it is clunked.  Each connection holds a reference for being
+// current and one for each fid opened on it.
+#define RECONMIN    100
+#define RECONMAX    5000
+#define RECONTIME   30000
+
+typedef struct Conn Conn;
+
+struct Conn {
+    Npcfsys *fs;
+    LONG ref;
+    Conn *next;
+};
+
+static CRITICAL_SECTION connlk;
+static CRITICAL_SECTION reconlk;
+static Conn *conn = NULL;           // current connection
+static Conn *conns = NULL;          // every connection still in use
+static char *mntaddr = NULL;
+static char *authaddr = NULL;
+static struct npcauth mntauth;
+static int dotu = 1;
+static volatile LONG nfids = 0;
+static volatile LONG nreconnects = 0;
+
+// Mounting is timed by phase: resolving the server addresses, which
+// is done for both servers at once, and connecting and attaching,
+// of which authentication is timed separately.
+typedef struct Resolve Resolve;
+
+struct Resolve {
+    char *addr;
+    int port;
+    struct addrinfo *ai;
+};
+
+static int mnttimes = 0;
+static DWORD tauth;
+
+static DWORD WINAPI
+resolveProc(LPVOID arg)
+{
+    Resolve *r = arg;
+
+    r->ai = npc_netaddr(r->addr, r->port);
+    return 0;
+}
+
+static int
+authTimed(Npcfid *afid, Npuser *u, void *aux)
+{
+    DWORD t0;
+    int r;
+
+    t0 = GetTickCount();
+    r = authp9any(afid, u, aux);
+    tauth = GetTickCount() - t0;
+    return r;
+}
+
+// Connect to the file server and attach, authenticating if a password
+// was given.  The addresses are looked up once and kept for
+// reconnecting; they are looked up again after a failed mount in case
+// the server has moved.
+static struct addrinfo *mntai = NULL;
+static struct addrinfo *authai = NULL;
+
+static Npcfsys *
+mountFs(void)
+{
+    Resolve ar;
+    Npcfsys *fs;
+    DWORD t0, t1, t2;
+    HANDLE h;
+
+    t0 = GetTickCount();
+    tauth = 0;
+    if(!mntai) {
+        h = NULL;
+        ar.ai = NULL;
+        if(authaddr) {
+            ar.addr = authaddr;
+            ar.port = 567;
+            h = CreateThread(NULL, 0, resolveProc, &ar, 0, NULL);
+            if(!h)
+                resolveProc(&ar);
+        }
+        mntai = npc_netaddr(mntaddr, 564);
+        if(h) {
+            WaitForSingleObject(h, INFINITE);
+            CloseHandle(h);
+        }
+        if(authai)
+            freeaddrinfo(authai);
+        authai = ar.ai;
+    }
+    t1 = GetTickCount();
+
+    fs = NULL;
+    if(mntai && authaddr) {
+        mntauth.srv = authai;
+        fs = npc_netmount(mntai, dotu, user, 564, authTimed, &mntauth);
+    } else if(mntai) {
+        fs = npc_netmount(mntai, dotu, user, 564, NULL, NULL);
+    }
+    t2 = GetTickCount();
+    if(mnttimes)
+        fprintf(stderr, "mount %s: resolve %lums, connect and attach %lums (auth %lums), total %lums\n",
+            fs ? "ok" : "failed", t1 - t0, t2 - t1, tauth, t2 - t0);
+    if(!fs && mntai) {
+        freeaddrinfo(mntai);
+        mntai = NULL;
+    }
+    return fs;
+}
+
+static void
+connInit(Npcfsys *fs)
+{
+    InitializeCriticalSection(&connlk);
+    InitializeCriticalSection(&reconlk);
+    conn = calloc(1, sizeof *conn);
+    conn->fs = fs;
+    conn->ref = 1;
+    conns = conn;
+}
+
+static Npcfsys *
+connFs(void)
+{
+    Npcfsys *fs;
+
+    EnterCriticalSection(&connlk);
+    fs = conn->fs;
+    LeaveCriticalSection(&connlk);
+    return fs;
+}
+
+static Conn *
+getConn(void)
+{
+    Conn *c;
+
+    EnterCriticalSection(&connlk);
+    c = conn;
+    c->ref++;
+    LeaveCriticalSection(&connlk);
+    return c;
+}
+
+static void
+putConn(Conn *c)
+{
+    Conn **l;
+    int last;
+
+    EnterCriticalSection(&connlk);
+    last = --c->ref == 0;
+    if(last) {
+        for(l = &conns; *l != c; l = &(*l)->next)
+            ;
+        *l = c->next;
+    }
+    LeaveCriticalSection(&connlk);
+    if(last) {
+        npc_umount(c->fs);
+        free(c);
+    }
+}
+
+// Replace the connection old, which has gone.  Tries with backoff for
+// up to RECONTIME ms.  Returns 1 if there is a new connection.
+static int
+reconnect(Npcfsys *old)
+{
+    Npcfsys *fs;
+    DWORD t0, delay;
+    Conn *c, *oc;
+
+    EnterCriticalSection(&reconlk);
+    if(connFs() != old) {
+        LeaveCriticalSection(&reconlk);
+        return 1;
+    }
+    fprintf(stderr, "connection lost, reconnecting\n");
+    t0 = GetTickCount();
+    for(delay = RECONMIN; (fs = mountFs()) == NULL; delay *= 2) {
+        if(GetTickCount() - t0 > RECONTIME) {
+            LeaveCriticalSection(&reconlk);
+            fprintf(stderr, "reconnect failed\n");
+            return 0;
+        }
+        Sleep(delay < RECONMAX ? delay : RECONMAX);
+    }
+    c = calloc(1, sizeof *c);
+    if(!c) {
+        npc_umount(fs);
+        LeaveCriticalSection(&reconlk);
+        return 0;
+    }
+    c->fs = fs;
+    c->ref = 1;
+
+    EnterCriticalSection(&connlk);
+    oc = conn;
+    c->next = conns;
+    conns = c;
+    conn = c;
+    LeaveCriticalSection(&connlk);
+    putConn(oc);
+    InterlockedIncrement(&nreconnects);
+    fprintf(stderr, "reconnected in %.1fs\n", (GetTickCount() - t0) / 1000.0);
+    LeaveCriticalSection(&reconlk);
+    return 1;
+}
+
+// After a request on fs has failed, decide whether the connection has
+// gone and if so replace it.  Only the errors npclient reports when
+// the socket fails or is closed count; an Rerror from the server, with
+// or without an errno, means the connection is still there.  Returns
+// 1 if the request should be retried on the new connection.
+static int
+connLost(Npcfsys *fs)
+{
+    char *ename;
+    int ecode;
+
+    np_rerror(&ename, &ecode);
+    switch(ecode) {
+    case ECONNRESET:
+    case ECONNABORTED:
+    case ENOTCONN:
+    case ETIMEDOUT:
+    case EPIPE:
+    case WSAECONNRESET:
+    case WSAECONNABORTED:
+    case WSAENOTCONN:
+    case WSAETIMEDOUT:
+    case WSAESHUTDOWN:
+    case WSAENETRESET:
+        break;
+    default:
+        return 0;
+    }
+    if(connFs() != fs)
+        return 1;
+    return reconnect(fs);
+}
+
+// Fids are opened and clunked through these so that leaks show up in
+// the statistics and so each fid holds its connection.  Opens are
+// retried if the connection was lost; creates are not, since the
+// create may have happened.
+static Npcfid *
+fidOpen(char *path, int omode)
+{
+    Npcfid *fid;
+    Conn *c;
+
+    c = getConn();
+    fid = npc_open(c->fs, path, omode);
+    if(!fid && connLost(c->fs)) {
+        putConn(c);
+        c = getConn();
+        fid = npc_open(c->fs, path, omode);
+    }
+    if(!fid) {
+        putConn(c);
+        return NULL;
+    }
+    InterlockedIncrement(&nfids);
+    return fid;
+}
+
+static Npcfid *
+fidCreate(char *path, u32 perm, int omode)
+{
+    Npcfid *fid;
+    Conn *c;
+
+    c = getConn();
+    fid = npc_create(c->fs, path, perm, omode);
+    if(!fid) {
+        connLost(c->fs);
+        putConn(c);
+        return NULL;
+    }
+    InterlockedIncrement(&nfids);
+    return fid;
+}
+
+static void
+fidClose(Npcfid *fid)
+{
+    Conn *c;
+
+    EnterCriticalSection(&connlk);
+    for(c = conns; c && c->fs != fid->fsys; c = c->next)
+        ;
+    LeaveCriticalSection(&connlk);
+    InterlockedDecrement(&nfids);
+    npc_close(fid);
+    if(c)
+        putConn(c);
+}
+
+static Npwstat *
+fsStat(char *path)
+{
+    Npwstat *st;
+    Conn *c;
+
+    c = getConn();
+    st = npc_stat(c->fs, path);
+    if(!st && connLost(c->fs)) {
+        putConn(c);
+        c = getConn();
+        st = npc_stat(c->fs, path);
+    }
+    putConn(c);
+    return st;
+}
+
+// Wstat path, retrying on a new connection only if doing it twice
+// is harmless.
+static int
+fsWstat(char *path, Npwstat *st, int idem)
+{
+    Conn *c;
+    int r;
+
+    c = getConn();
+    r = npc_wstat(c->fs, path, st);
+    if(r < 0 && connLost(c->fs) && idem) {
+        putConn(c);
+        c = getConn();
+        r = npc_wstat(c->fs, path, st);
+    }
+    putConn(c);
+    return r;
+}
+
+static int
+fsRemove(char *path)
+{
+    Conn *c;
+    int r;
+
+    c = getConn();
+    r = npc_remove(c->fs, path);
+    if(r < 0)
+        connLost(c->fs);
+    putConn(c);
+    return r;
+}
+
+// A Dokan handle.  The path and mode are kept so that the fid can be
+// opened again when the connection is replaced; the qid must match or
+// the file has been replaced and the handle stays dead.  Fids from old
+// connections are kept until the handle is closed as other threads
+// may still be using them.  Under a writeback policy, sequential
+// writes collect in wb until it fills or the handle is flushed.
+typedef struct Handle Handle;
+
+struct Handle {
+    CRITICAL_SECTION lk;
+    Npcfid *fid;
+    Npcfid **old;
+    int nold;
+    char *path;
+    int omode;
+    Npqid qid;
+    int wback;
+    u8 *wb;
+    u32 wblen;
+    u64 wboff;
+};
+
+static Handle *
+newHandle(Npcfid *fid, char *path, int omode)
+{
+    Handle *h;
+
+    h = calloc(1, sizeof *h);
+    if(!h)
+        return NULL;
+    h->path = strdup(path);
+    if(!h->path) {
+        free(h);
+        return NULL;
+    }
+    InitializeCriticalSection(&h->lk);
+    h->fid = fid;
+    h->omode = omode & ~Otrunc;
+    h->qid = fid->qid;
+    return h;
+}
+
+static void
+freeHandle(Handle *h)
+{
+    int i;
+
+    fidClose(h->fid);
+    for(i = 0; i < h->nold; i++)
+        fidClose(h->old[i]);
+    free(h->old);
+    free(h->wb);
+    DeleteCriticalSection(&h->lk);
+    free(h->path);
+    free(h);
+}
+
+// Return h's fid, opened again if its connection has been replaced.
+static Npcfid *
+hFid(Handle *h)
+{
+    Npcfid *fid, **v;
+
+    if(!h)
+        return NULL;
+    EnterCriticalSection(&h->lk);
+    if(h->fid->fsys != connFs()) {
+        fid = fidOpen(h->path, h->omode);
+        if(fid && fid->qid.path != h->qid.path) {
+            fidClose(fid);
+            fid = NULL;
+        }
+        if(fid) {
+            v = realloc(h->old, (h->nold + 1) * sizeof *v);
+            if(v) {
+                h->old = v;
+                h->old[h->nold++] = h->fid;
+                h->fid = fid;
+            } else {
+                fidClose(fid);
+            }
+        }
+    }
+    fid = h->fid;
+    LeaveCriticalSection(&h->lk);
+    return fid;
+}
+
 static void
 maybeOpen(LPCWSTR fname, int omode, int *opened, Npcfid **fidp)
 {
@@ -184,7 +645,7 @@ maybeOpen(LPCWSTR fname, int omode, int *opened, Npcfid **fidp)
     if(*fidp)
         return;
     fn = p9path(fname);
-    *fidp = npc_open(fs, fn, omode);
+    *fidp = fidOpen(fn, omode);
     if(*fidp)
         *opened = 1;
     free(fn);
@@ -194,7 +655,243 @@ static void
 maybeClose(int *opened, Npcfid **fidp)
 {
     if(*opened)
-        npc_close(*fidp);
+        fidClose(*fidp);
+}
+
+// Largest transfer a single Tread or Twrite on fid can carry: the
+// iounit from Ropen, or DEFIOUNIT if the server gave none, capped by
+// -m.
+static u32
+xferSize(Npcfid *fid)
+{
+    u32 n;
+
+    n = fid->iounit ? fid->iounit : DEFIOUNIT;
+    if(maxmsg && n > maxmsg - IOHDRSZ)
+        n = maxmsg - IOHDRSZ;
+    return n;
+}
+
+// With -d, report the transfer size the root's iounit and -m allow.
+// This costs a round trip, so it is only done when asked for.
+static void
+checkMsize(void)
+{
+    Npcfid *fid;
+
+    if(!debug)
+        return;
+    fid = fidOpen("/", Oread);
+    if(!fid)
+        return;
+    fprintf(stderr, "transfers of up to %u bytes\n", xferSize(fid));
+    fidClose(fid);
+}
+
+// The I/O engine.  A request bigger than one iounit is cut into
+// chunks that are posted to a pool of worker threads through an I/O
+// completion port.  npclient multiplexes tags over the connection,
+// so the chunks are in flight together instead of one round trip
+// after another.
+#define MAXFAN      16
+
+typedef struct Batch Batch;
+typedef struct Job Job;
+typedef struct Xfer Xfer;
+
+struct Batch {
+    volatile LONG pending;
+    HANDLE done;
+};
+
+struct Job {
+    void (*fn)(Job *);
+    Batch *batch;
+};
+
+struct Xfer {
+    Job job;
+    Npcfid *fid;
+    u8 *buf;
+    u32 count;
+    u64 off;
+    int write;
+    int r;
+};
+
+static HANDLE ioport = NULL;
+
+static DWORD WINAPI
+jobProc(LPVOID arg)
+{
+    LPOVERLAPPED ov;
+    ULONG_PTR key;
+    DWORD n;
+    Batch *b;
+    Job *j;
+
+    while(GetQueuedCompletionStatus(ioport, &n, &key, &ov, INFINITE)) {
+        j = (Job *)key;
+        b = j->batch;   // j may be freed by fn
+        j->fn(j);
+        if(b && InterlockedDecrement(&b->pending) == 0)
+            SetEvent(b->done);
+    }
+    return 0;
+}
+
+static int
+engineInit(int nthr)
+{
+    HANDLE h;
+    int i;
+
+    ioport = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, nthr);
+    if(!ioport)
+        return -1;
+    for(i = 0; i < nthr; i++) {
+        h = CreateThread(NULL, 0, jobProc, NULL, 0, NULL);
+        if(!h)
+            break;
+        CloseHandle(h);
+    }
+    if(i == 0) {
+        CloseHandle(ioport);
+        ioport = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Queue j on the engine.  The caller holds one count on b and
+// waits for it with batchWait.
+static void
+submit(Job *j, Batch *b)
+{
+    j->batch = b;
+    if(b)
+        InterlockedIncrement(&b->pending);
+    PostQueuedCompletionStatus(ioport, 0, (ULONG_PTR)j, NULL);
+}
+
+static void
+batchWait(Batch *b)
+{
+    if(InterlockedDecrement(&b->pending) != 0)
+        WaitForSingleObject(b->done, INFINITE);
+}
+
+static void
+xferProc(Job *j)
+{
+    Xfer *x = (Xfer *)j;
+
+    if(x->write)
+        x->r = npc_write(x->fid, x->buf, x->count, x->off);
+    else
+        x->r = npc_read(x->fid, x->buf, x->count, x->off);
+}
+
+// Whether fid is a file whose offsets mean what they say, so that its
+// chunks can be sent together and answered in any order.  Streams,
+// pipes, /net data files and the like ignore the offset; they have a
+// qid version of 0, while servers bump the version of stored files
+// as they change.  Anything else with a type bit set is kept in order.
+static int
+stored(Npcfid *fid)
+{
+    return fid->qid.type == 0 && fid->qid.version != 0;
+}
+
+// Move count bytes between buf and fid at off, one iounit per Tread
+// or Twrite, straight into or out of buf.  Returns the number of bytes
+// moved, which is short only at end of file or if a later chunk
+// fails, or -1 if nothing could be moved.  Only stored files are
+// fanned out; anything else is sent one request at a time, and a read
+// from it is a single Tread.
+static int
+xfer(Npcfid *fid, u8 *buf, u32 count, u64 off, int write)
+{
+    Xfer x[MAXFAN];
+    Batch b;
+    u32 tot, pos, n, max;
+    int i, nx, fan;
+
+    max = xferSize(fid);
+    if(!write && !stored(fid)) {
+        // a stream hands back what it has; asking again would block
+        // for more than the caller wanted to wait for.
+        x[0].fid = fid;
+        x[0].buf = buf;
+        x[0].count = count < max ? count : max;
+        x[0].off = off;
+        x[0].write = 0;
+        xferProc(&x[0].job);
+        return x[0].r;
+    }
+    fan = MAXFAN;
+    if(!ioport || !stored(fid))
+        fan = 1;
+    b.done = NULL;
+    tot = 0;
+    while(tot < count) {
+        pos = tot;
+        for(nx = 0; nx < fan && pos < count; nx++) {
+            n = count - pos;
+            if(n > max)
+                n = max;
+            x[nx].job.fn = xferProc;
+            x[nx].fid = fid;
+            x[nx].buf = buf + pos;
+            x[nx].count = n;
+            x[nx].off = off + pos;
+            x[nx].write = write;
+            pos += n;
+        }
+
+        if(nx > 1 && !b.done)
+            b.done = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if(nx > 1 && b.done) {
+            ResetEvent(b.done);
+            b.pending = 1;
+            for(i = 1; i < nx; i++)
+                submit(&x[i].job, &b);
+            xferProc(&x[0].job);
+            batchWait(&b);
+        } else {
+            for(i = 0; i < nx; i++)
+                xferProc(&x[i].job);
+        }
+
+        // the first chunk ran on this thread, so a failure with
+        // nothing moved leaves its error for the caller.
+        for(i = 0; i < nx; i++) {
+            if(x[i].r < 0) {
+                if(tot == 0)
+                    tot = (u32)-1;
+                goto out;
+            }
+            tot += x[i].r;
+            if((u32)x[i].r < x[i].count)
+                goto out;
+        }
+    }
+out:
+    if(b.done)
+        CloseHandle(b.done);
+    return (int)tot;
+}
+
+static int
+readAll(Npcfid *fid, u8 *buf, u32 count, u64 off)
+{
+    return xfer(fid, buf, count, off, 0);
+}
+
+static int
+writeAll(Npcfid *fid, u8 *buf, u32 count, u64 off)
+{
+    return xfer(fid, buf, count, off, 1);
 }
 
 static u32
@@ -284,137 +981,2519 @@ cvtError(void)
     }
 }
 
+// Copy n stats into a single allocation.  Only the names are kept.
+static Npwstat *
+statPack(Npwstat *v, int n)
+{
+    Npwstat *p;
+    char *s;
+    size_t sz;
+    int i;
+
+    sz = n * sizeof *p;
+    for(i = 0; i < n; i++)
+        sz += strlen(v[i].name) + 1;
+    p = malloc(sz ? sz : 1);
+    if(!p)
+        return NULL;
+    s = (char *)(p + n);
+    for(i = 0; i < n; i++) {
+        p[i] = v[i];
+        p[i].uid = p[i].gid = p[i].muid = p[i].extension = NULL;
+        strcpy(s, v[i].name);
+        p[i].name = s;
+        s += strlen(s) + 1;
+    }
+    return p;
+}
 
+// Read all of directory fn into a packed array.
 static int
-_CreateFile(
-    LPCWSTR                 FileName,
-    DWORD                   AccessMode,
-    DWORD                   ShareMode,
-    DWORD                   CreationDisposition,
-    DWORD                   FlagsAndAttributes,
-    PDOKAN_FILE_INFO        DokanFileInfo)
+listDir(char *fn, Npwstat **stp, int *np)
 {
-    Npcfid *fid = NULL;
-    char *fn;
-    int omode, rd, wr;
-
-    if(debug)
-        fprintf(stderr, "createfile '%ws' create %d access %x flags %x\n", FileName, CreationDisposition, AccessMode, FlagsAndAttributes);
-    rd = (AccessMode & (GENERIC_READ | FILE_READ_DATA)) != 0;
-    wr = (AccessMode & (GENERIC_WRITE | FILE_WRITE_DATA)) != 0;
-    if(rd && wr)
-        omode = Ordwr;
-    else if(wr)
-        omode = Owrite;
-    else
-        omode = Oread;
-    if(CreationDisposition == TRUNCATE_EXISTING)
-        omode |= Otrunc;
+    Npwstat *st, *all, **chunks, *v, **cv;
+    Npcfid *fid;
+    int cnt, n, nchunk, i, e;
 
-    fn = p9path(FileName);
-    if(!fn)
-        return -(int)ERROR_NOT_ENOUGH_MEMORY;
-    fid = npc_open(fs, fn, omode);
-    if(!fid && (CreationDisposition == CREATE_ALWAYS || 
-                CreationDisposition == CREATE_NEW ||
-                CreationDisposition == OPEN_ALWAYS)) {
-        fid = npc_create(fs, fn, 0666, omode);
-    }
-    free(fn);
-    if(!fid) {
+    fid = fidOpen(fn, Oread);
+    if(!fid)
+        return cvtError();
+    all = NULL;
+    chunks = NULL;
+    n = nchunk = 0;
+    e = 0;
+    for(;;) {
+        cnt = npc_dirread(fid, &st);
+        if(cnt == 0)
+            break;
+        if(cnt < 0) {
+            e = cvtError();
+            break;
+        }
+        v = realloc(all, (n + cnt) * sizeof *all);
+        cv = realloc(chunks, (nchunk + 1) * sizeof *chunks);
+        if(v)
+            all = v;
+        if(cv)
+            chunks = cv;
+        if(!v || !cv) {
+            free(st);
+            e = -(int)ERROR_NOT_ENOUGH_MEMORY;
+            break;
+        }
+        memcpy(all + n, st, cnt * sizeof *st);
+        chunks[nchunk++] = st;
+        n += cnt;
+    }
+    fidClose(fid);
+
+    if(!e) {
+        *stp = statPack(all, n);
+        *np = n;
+        if(!*stp)
+            e = -(int)ERROR_NOT_ENOUGH_MEMORY;
+    }
+    for(i = 0; i < nchunk; i++)
+        free(chunks[i]);
+    free(chunks);
+    free(all);
+    return e;
+}
+
+// Return a dynamically allocated path for name in directory dir.
+static char *
+pathJoin(char *dir, char *name)
+{
+    char *p;
+
+    p = malloc(strlen(dir) + strlen(name) + 2);
+    if(p)
+        sprintf(p, "%s%s%s", dir, strcmp(dir, "/") ? "/" : "", name);
+    return p;
+}
+
+// Policies.  A file given with -f sets cache and write policies for
+// subtrees of the server.  Each line is a path prefix followed by
+// options; a "*" in the path matches any one name, and the longest
+// matching prefix wins.
+//
+//  attr=secs   keep attributes for secs seconds
+//  dir=secs    keep directory listings for secs seconds
+//  immutable   keep attributes and listings until evicted
+//  nocache     don't cache
+//  writeback   buffer sequential writes until flush or close
+//  writethrough    send every write as it is made
+//  prefetch    prefetch listings below here
+//  noprefetch  don't
+//
+// Options not given take the values from the command line.  The
+// prefixes are kept in a trie of path names that is walked on each
+// lookup.
+#define PFDEPTH     2
+#define PFTTL       10000
+
+enum {
+    Pimmutable  = 1,
+    Pwriteback  = 2,
+    Pprefetch   = 4,
+};
+
+typedef struct Policy Policy;
+typedef struct Pnode Pnode;
+
+struct Policy {
+    DWORD attrttl;
+    DWORD dirttl;
+    int flags;
+};
+
+struct Pnode {
+    char *name;
+    Pnode *kids;
+    Pnode *sib;
+    Policy *pol;
+};
+
+static Policy defpol;
+static Pnode *ptree = NULL;
+static int cacheon = 0;
+static int pfany = 0;
+
+static void
+polInit(DWORD ttl, int pf)
+{
+    defpol.attrttl = ttl;
+    defpol.dirttl = ttl;
+    defpol.flags = pf ? Pprefetch : 0;
+    cacheon = ttl != 0;
+    pfany = pf;
+}
+
+// Find the policy of the longest prefix of path p in the trie under
+// n, which is depth names deep.  Both the child named by the next
+// element and a "*" child are searched and the deeper match kept, the
+// named child winning a tie.  Returns the depth of the match with the
+// policy in *pp, or -1 if nothing matches.
+static int
+plook(Pnode *n, char *p, int depth, Policy **pp)
+{
+    Policy *r;
+    Pnode *k, *star;
+    size_t l;
+    int d, best;
+
+    best = -1;
+    if(n->pol) {
+        *pp = n->pol;
+        best = depth;
+    }
+    while(*p == '/')
+        p++;
+    if(!*p)
+        return best;
+    l = strcspn(p, "/");
+    star = NULL;
+    for(k = n->kids; k; k = k->sib) {
+        if(strcmp(k->name, "*") == 0)
+            star = k;
+        else if(strlen(k->name) == l && strncmp(k->name, p, l) == 0)
+            break;
+    }
+    if(k && (d = plook(k, p + l, depth + 1, &r)) > best) {
+        *pp = r;
+        best = d;
+    }
+    for(; !star && k; k = k->sib)
+        if(strcmp(k->name, "*") == 0)
+            star = k;
+    if(star && (d = plook(star, p + l, depth + 1, &r)) > best) {
+        *pp = r;
+        best = d;
+    }
+    return best;
+}
+
+static Policy *
+policy(char *path)
+{
+    Policy *p;
+
+    if(!ptree || plook(ptree, path, 0, &p) < 0)
+        return &defpol;
+    return p;
+}
+
+static int
+polAdd(char *path, Policy *pol)
+{
+    Pnode *n, *k;
+    char *p;
+    size_t l;
+
+    if(!ptree && (ptree = calloc(1, sizeof *ptree)) == NULL)
+        return -1;
+    n = ptree;
+    for(p = path; *p; p += l) {
+        while(*p == '/' || *p == '\\')
+            p++;
+        if(!*p)
+            break;
+        l = strcspn(p, "/\\");
+        for(k = n->kids; k; k = k->sib)
+            if(strlen(k->name) == l && strncmp(k->name, p, l) == 0)
+                break;
+        if(!k) {
+            k = calloc(1, sizeof *k);
+            if(!k || (k->name = malloc(l + 1)) == NULL) {
+                free(k);
+                return -1;
+            }
+            memcpy(k->name, p, l);
+            k->name[l] = 0;
+            k->sib = n->kids;
+            n->kids = k;
+        }
+        n = k;
+    }
+    free(n->pol);
+    n->pol = pol;
+    return 0;
+}
+
+static int
+loadPolicy(char *file)
+{
+    Policy *pol;
+    FILE *f;
+    char line[1024], *path, *tok, *p;
+    int lineno, nocache;
+
+    f = fopen(file, "r");
+    if(!f) {
+        fprintf(stderr, "cannot open %s\n", file);
+        return -1;
+    }
+    for(lineno = 1; fgets(line, sizeof line, f); lineno++) {
+        if((p = strchr(line, '#')) != NULL)
+            *p = 0;
+        path = strtok(line, " \t\r\n");
+        if(!path)
+            continue;
+        pol = malloc(sizeof *pol);
+        if(!pol)
+            goto err;
+        *pol = defpol;
+        nocache = 0;
+        while((tok = strtok(NULL, " \t\r\n")) != NULL) {
+            if(strncmp(tok, "attr=", 5) == 0) {
+                pol->attrttl = atoi(tok + 5) * 1000;
+                nocache = 0;
+            } else if(strncmp(tok, "dir=", 4) == 0) {
+                pol->dirttl = atoi(tok + 4) * 1000;
+                nocache = 0;
+            } else if(strcmp(tok, "immutable") == 0) {
+                pol->flags |= Pimmutable;
+            } else if(strcmp(tok, "nocache") == 0) {
+                pol->flags &= ~Pimmutable;
+                pol->attrttl = pol->dirttl = 0;
+                nocache = 1;
+            } else if(strcmp(tok, "writeback") == 0) {
+                pol->flags |= Pwriteback;
+            } else if(strcmp(tok, "writethrough") == 0) {
+                pol->flags &= ~Pwriteback;
+            } else if(strcmp(tok, "prefetch") == 0) {
+                pol->flags |= Pprefetch;
+            } else if(strcmp(tok, "noprefetch") == 0) {
+                pol->flags &= ~Pprefetch;
+            } else {
+                fprintf(stderr, "%s:%d: unknown option %s\n", file, lineno, tok);
+                free(pol);
+                fclose(f);
+                return -1;
+            }
+        }
+        // prefetching into a cache that keeps nothing is wasted, so
+        // prefetch without a lifetime caches as P does without C.
+        if((pol->flags & Pprefetch) && !nocache
+        && !pol->attrttl && !pol->dirttl && !(pol->flags & Pimmutable))
+            pol->attrttl = pol->dirttl = PFTTL;
+        if(pol->attrttl || pol->dirttl || (pol->flags & Pimmutable))
+            cacheon = 1;
+        if(pol->flags & Pprefetch)
+            pfany = 1;
+        if(polAdd(path, pol) < 0) {
+            free(pol);
+            goto err;
+        }
+    }
+    fclose(f);
+    return 0;
+
+err:
+    fprintf(stderr, "%s:%d: out of memory\n", file, lineno);
+    fclose(f);
+    return -1;
+}
+
+// Whether an entry for path made at when may still be used.
+static int
+isFresh(char *path, DWORD when, int dir)
+{
+    Policy *p;
+
+    p = policy(path);
+    if(p->flags & Pimmutable)
+        return 1;
+    return GetTickCount() - when < (dir ? p->dirttl : p->attrttl);
+}
+
+static int
+cacheable(char *path, int dir)
+{
+    Policy *p;
+
+    p = policy(path);
+    return (p->flags & Pimmutable) || (dir ? p->dirttl : p->attrttl);
+}
+
+// Metadata cache.  Attributes and directory listings are kept by
+// path for as long as the path's policy allows.  Listing a directory
+// also caches the attributes of everything in it, so the stats
+// Explorer makes after a listing are answered locally.  Creating,
+// removing or renaming a file drops its entry and its parent's
+// listing; writing to it or changing its attributes drops only its
+// entry, so sizes in a cached listing may lag until it expires.
+#define NCHASH      4096
+#define CACHEMAX    32768
+
+typedef struct Cent Cent;
+
+struct Cent {
+    Cent *hnext;
+    Cent *prev, *next;  // lru, most recent first
+    char *path;
+    u32 hash;
+    int hasst;
+    DWORD stwhen;
+    Npwstat st;
+    Npwstat *dir;
+    int ndir;
+    DWORD dirwhen;
+    int prefetched;     // filled by prefetch and not yet used
+};
+
+static CRITICAL_SECTION cachelk;
+static Cent *chash[NCHASH];
+static Cent clru;
+static int ncent = 0;
+static DWORD cachettl = 0;
+static int cachemax = CACHEMAX;
+static int cachefixed = 0;          // cachemax was given with -C
+static volatile LONG pfhits = 0;
+
+static void
+cacheInit(void)
+{
+    InitializeCriticalSection(&cachelk);
+    clru.next = clru.prev = &clru;
+}
+
+static u32
+strHash(char *s)
+{
+    u32 h;
+
+    for(h = 0; *s; s++)
+        h = h * 31 + (u8)*s;
+    return h;
+}
+
+static void
+cfree(Cent *c)
+{
+    Cent **l;
+
+    for(l = &chash[c->hash % NCHASH]; *l != c; l = &(*l)->hnext)
+        ;
+    *l = c->hnext;
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    ncent--;
+    free(c->dir);
+    free(c->path);
+    free(c);
+}
+
+// Find the entry for path, creating it if asked.  Called with
+// cachelk held.
+static Cent *
+clook(char *path, int create)
+{
+    Cent *c;
+    u32 h;
+
+    h = strHash(path);
+    for(c = chash[h % NCHASH]; c; c = c->hnext)
+        if(c->hash == h && strcmp(c->path, path) == 0)
+            break;
+    if(c) {
+        c->prev->next = c->next;
+        c->next->prev = c->prev;
+    } else {
+        if(!create)
+            return NULL;
+        c = calloc(1, sizeof *c);
+        if(!c)
+            return NULL;
+        c->path = strdup(path);
+        if(!c->path) {
+            free(c);
+            return NULL;
+        }
+        c->hash = h;
+        c->hnext = chash[h % NCHASH];
+        chash[h % NCHASH] = c;
+        ncent++;
+    }
+    c->next = clru.next;
+    c->prev = &clru;
+    clru.next->prev = c;
+    clru.next = c;
+    if(ncent > cachemax)
+        cfree(clru.prev);
+    return c;
+}
+
+static void
+cpfhit(Cent *c)
+{
+    if(c->prefetched) {
+        c->prefetched = 0;
+        InterlockedIncrement(&pfhits);
+    }
+}
+
+// Look up the attributes of path.  The names in st are not kept.
+static int
+cacheStat(char *path, Npwstat *st)
+{
+    Cent *c;
+    int r;
+
+    if(!cacheon)
+        return -1;
+    r = -1;
+    EnterCriticalSection(&cachelk);
+    c = clook(path, 0);
+    if(c && c->hasst && isFresh(path, c->stwhen, 0)) {
+        *st = c->st;
+        cpfhit(c);
+        r = 0;
+    }
+    LeaveCriticalSection(&cachelk);
+    return r;
+}
+
+// Called with cachelk held.
+static void
+cputStat(char *path, Npwstat *st, int pf)
+{
+    Cent *c;
+
+    if(!cacheable(path, 0))
+        return;
+    c = clook(path, 1);
+    if(!c)
+        return;
+    c->st = *st;
+    c->st.name = c->st.uid = c->st.gid = c->st.muid = c->st.extension = NULL;
+    c->hasst = 1;
+    c->stwhen = GetTickCount();
+    c->prefetched = pf;
+}
+
+static void
+cachePutStat(char *path, Npwstat *st, int pf)
+{
+    if(!cacheon)
+        return;
+    EnterCriticalSection(&cachelk);
+    cputStat(path, st, pf);
+    LeaveCriticalSection(&cachelk);
+}
+
+// Return a packed copy of path's listing, or NULL.
+static Npwstat *
+cacheDir(char *path, int *np)
+{
+    Npwstat *st;
+    Cent *c;
+
+    if(!cacheon)
+        return NULL;
+    st = NULL;
+    EnterCriticalSection(&cachelk);
+    c = clook(path, 0);
+    if(c && c->dir && isFresh(path, c->dirwhen, 1)) {
+        st = statPack(c->dir, c->ndir);
+        *np = c->ndir;
+        cpfhit(c);
+    }
+    LeaveCriticalSection(&cachelk);
+    return st;
+}
+
+static int
+cacheHasDir(char *path)
+{
+    Cent *c;
+    int r;
+
+    if(!cacheon)
+        return 0;
+    EnterCriticalSection(&cachelk);
+    c = clook(path, 0);
+    r = c && c->dir && isFresh(path, c->dirwhen, 1);
+    LeaveCriticalSection(&cachelk);
+    return r;
+}
+
+static void
+cachePutDir(char *path, Npwstat *st, int n, int pf)
+{
+    Npwstat *dir;
+    char *cp;
+    Cent *c;
+    int i;
+
+    if(!cacheon)
+        return;
+    dir = NULL;
+    if(cacheable(path, 1) && (dir = statPack(st, n)) == NULL)
+        return;
+    EnterCriticalSection(&cachelk);
+    c = dir ? clook(path, 1) : NULL;
+    if(c) {
+        free(c->dir);
+        c->dir = dir;
+        c->ndir = n;
+        c->dirwhen = GetTickCount();
+        c->prefetched = pf;
+    } else {
+        free(dir);
+    }
+    for(i = 0; i < n; i++) {
+        if(!st[i].name[0])
+            continue;
+        cp = pathJoin(path, st[i].name);
+        if(cp)
+            cputStat(cp, &st[i], pf);
+        free(cp);
+    }
+    LeaveCriticalSection(&cachelk);
+}
+
+// Drop the listing of path's parent, or only if it never expires
+// when immonly is set.  Called with cachelk held.
+static void
+cforgetParent(char *path, int immonly)
+{
+    char *p, *par;
+    size_t l;
+    Cent *c;
+
+    p = strrchr(path, '/');
+    if(!p)
+        return;
+    l = p - path;
+    if(l == 0)
+        l = 1;
+    par = malloc(l + 1);
+    if(!par)
+        return;
+    memcpy(par, path, l);
+    par[l] = 0;
+    if(!immonly || (policy(par)->flags & Pimmutable)) {
+        c = clook(par, 0);
+        if(c) {
+            free(c->dir);
+            c->dir = NULL;
+            c->ndir = 0;
+        }
+    }
+    free(par);
+}
+
+// Forget path and its parent's listing, and everything below path
+// if tree is set and path was cached as a directory.
+static void
+cacheForget(char *path, int tree)
+{
+    Cent *c, *next;
+    size_t l;
+    int isdir;
+
+    if(!cacheon || !path)
+        return;
+    EnterCriticalSection(&cachelk);
+    isdir = 0;
+    c = clook(path, 0);
+    if(c) {
+        isdir = c->dir || (c->hasst && (c->st.qid.type & Qtdir));
+        cfree(c);
+    }
+    cforgetParent(path, 0);
+    if(tree && isdir) {
+        l = strlen(path);
+        for(c = clru.next; c != &clru; c = next) {
+            next = c->next;
+            if(strncmp(c->path, path, l) == 0 && c->path[l] == '/')
+                cfree(c);
+        }
+    }
+    LeaveCriticalSection(&cachelk);
+}
+
+// Drop the attributes of path after its contents or attributes have
+// changed.  Its name is unchanged, so its parent's listing is kept
+// until it expires; an immutable one never would, so it goes too.
+static void
+cacheForgetStat(char *path)
+{
+    Cent *c;
+
+    if(!cacheon || !path)
+        return;
+    EnterCriticalSection(&cachelk);
+    c = clook(path, 0);
+    if(c && c->dir)
+        c->hasst = 0;
+    else if(c)
+        cfree(c);
+    cforgetParent(path, 1);
+    LeaveCriticalSection(&cachelk);
+}
+
+static void
+cacheForgetStatW(LPCWSTR FileName)
+{
+    char *fn;
+
+    if(!cacheon)
+        return;
+    fn = p9path(FileName);
+    cacheForgetStat(fn);
+    free(fn);
+}
+
+// Prefetch.  When a directory is listed in the foreground, its
+// subdirectories are listed by a low priority thread, down to
+// pfdepth levels and at most pfbudget entries per listing, so that
+// the next level of navigation is already cached.  The thread waits
+// while any foreground request is on the wire.
+#define PFQMAX      1024
+#define PFIDLE      20
+
+typedef struct Pfroot Pfroot;
+typedef struct Pfreq Pfreq;
+
+struct Pfroot {
+    volatile LONG left;
+    volatile LONG ref;
+};
+
+struct Pfreq {
+    Pfreq *next;
+    char *path;
+    int depth;
+    Pfroot *root;
+};
+
+static CRITICAL_SECTION pflk;
+static HANDLE pfwake = NULL;
+static Pfreq *pfhead = NULL, *pftail = NULL;
+static int pfqlen = 0;
+static int pfdepth = 0;
+static int pfbudget = 2048;
+static volatile LONG fgbusy = 0;
+static volatile LONG pfdirs = 0, pfents = 0, pfdrops = 0;
+
+static void
+fgEnter(void)
+{
+    InterlockedIncrement(&fgbusy);
+}
+
+static void
+fgLeave(void)
+{
+    InterlockedDecrement(&fgbusy);
+}
+
+static void
+pfRelease(Pfroot *r)
+{
+    if(InterlockedDecrement(&r->ref) == 0)
+        free(r);
+}
+
+// Queue the subdirectories of path, found in its listing st, for
+// prefetch at the given depth.
+static void
+prefetch(char *path, Npwstat *st, int n, int depth, Pfroot *root)
+{
+    Pfroot *r;
+    Pfreq *q;
+    char *cp;
+    int i;
+
+    if(!pfwake || depth > pfdepth)
+        return;
+    r = root;
+    if(!r) {
+        r = malloc(sizeof *r);
+        if(!r)
+            return;
+        r->left = pfbudget;
+        r->ref = 1;
+    }
+    for(i = 0; i < n && r->left > 0; i++) {
+        if(!(st[i].qid.type & Qtdir) || !st[i].name[0])
+            continue;
+        cp = pathJoin(path, st[i].name);
+        if(!cp)
+            break;
+        if(!(policy(cp)->flags & Pprefetch) || !cacheable(cp, 1)
+        || cacheHasDir(cp)) {
+            free(cp);
+            continue;
+        }
+        q = malloc(sizeof *q);
+        if(!q) {
+            free(cp);
+            break;
+        }
+        q->next = NULL;
+        q->path = cp;
+        q->depth = depth;
+        q->root = r;
+        InterlockedIncrement(&r->ref);
+
+        EnterCriticalSection(&pflk);
+        if(pfqlen >= PFQMAX) {
+            LeaveCriticalSection(&pflk);
+            InterlockedIncrement(&pfdrops);
+            pfRelease(r);
+            free(cp);
+            free(q);
+            break;
+        }
+        if(pftail)
+            pftail->next = q;
+        else
+            pfhead = q;
+        pftail = q;
+        pfqlen++;
+        LeaveCriticalSection(&pflk);
+    }
+    if(!root)
+        pfRelease(r);
+    SetEvent(pfwake);
+}
+
+static DWORD WINAPI
+pfProc(LPVOID arg)
+{
+    Npwstat *st;
+    Pfreq *q;
+    int n;
+
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+    for(;;) {
+        WaitForSingleObject(pfwake, INFINITE);
+        for(;;) {
+            EnterCriticalSection(&pflk);
+            q = pfhead;
+            if(q) {
+                pfhead = q->next;
+                if(!pfhead)
+                    pftail = NULL;
+                pfqlen--;
+            }
+            LeaveCriticalSection(&pflk);
+            if(!q)
+                break;
+
+            while(fgbusy > 0)
+                Sleep(PFIDLE);
+            if(q->root->left > 0 && !cacheHasDir(q->path)
+            && listDir(q->path, &st, &n) == 0) {
+                InterlockedExchangeAdd(&q->root->left, -n);
+                InterlockedIncrement(&pfdirs);
+                InterlockedExchangeAdd(&pfents, n);
+                cachePutDir(q->path, st, n, 1);
+                prefetch(q->path, st, n, q->depth + 1, q->root);
+                free(st);
+            }
+            pfRelease(q->root);
+            free(q->path);
+            free(q);
+        }
+    }
+    return 0;
+}
+
+static int
+pfInit(void)
+{
+    HANDLE h;
+
+    InitializeCriticalSection(&pflk);
+    pfwake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(!pfwake)
+        return -1;
+    h = CreateThread(NULL, 0, pfProc, NULL, 0, NULL);
+    if(!h) {
+        CloseHandle(pfwake);
+        pfwake = NULL;
+        return -1;
+    }
+    CloseHandle(h);
+    return 0;
+}
+
+
+// Compressed transport.  For slow links ninefs can talk to a server
+// through a relay that sends each 9p message as a frame, compressed
+// with LZNT1 when that pays.  Mounting "addr!z" starts the client end
+// on a loopback port and points npclient at it; "ninefs -z port addr"
+// is the server end, accepting compressed connections on port and
+// passing them on to the plain 9p server at addr.
+//
+// A frame is a header of two little-endian words, the length on the
+// wire (with ZFLAG set if compressed) and the message length, followed
+// by the message.
+#define ZHDRSZ      8
+#define ZFLAG       0x80000000
+#define ZMIN        256
+#define ZSAMPLE     4096
+#define ZMAXMSG     (16 * 1024 * 1024)
+#define ZCHUNK      4096
+#define ZFMT        (COMPRESSION_FORMAT_LZNT1 | COMPRESSION_ENGINE_STANDARD)
+
+typedef NTSTATUS (WINAPI *Rtlcompress)(USHORT, PUCHAR, ULONG, PUCHAR, ULONG, ULONG, PULONG, PVOID);
+typedef NTSTATUS (WINAPI *Rtldecompress)(USHORT, PUCHAR, ULONG, PUCHAR, ULONG, PULONG);
+typedef NTSTATUS (WINAPI *Rtlwssize)(USHORT, PULONG, PULONG);
+
+typedef struct Zconn Zconn;
+typedef struct Zpump Zpump;
+typedef struct Zrelay Zrelay;
+
+struct Zconn {
+    SOCKET raw;         // plain 9p side
+    SOCKET z;           // framed side
+    volatile LONG ref;
+};
+
+struct Zpump {
+    Zconn *c;
+    int pack;           // raw to z if set, else z to raw
+};
+
+struct Zrelay {
+    SOCKET l;
+    char *addr;
+    int client;
+};
+
+static Rtlcompress rtlCompress;
+static Rtldecompress rtlDecompress;
+static ULONG zwssize;
+static int zon = 0;
+static CRITICAL_SECTION zlk;
+static u64 zraw, zwire, zmsgs, zpacked;
+static LONGLONG zticks;
+
+static int
+zinit(void)
+{
+    Rtlwssize wssize;
+    HMODULE h;
+    ULONG frag;
+
+    h = GetModuleHandle(L"ntdll.dll");
+    if(!h)
+        return -1;
+    rtlCompress = (Rtlcompress)GetProcAddress(h, "RtlCompressBuffer");
+    rtlDecompress = (Rtldecompress)GetProcAddress(h, "RtlDecompressBuffer");
+    wssize = (Rtlwssize)GetProcAddress(h, "RtlGetCompressionWorkSpaceSize");
+    if(!rtlCompress || !rtlDecompress || !wssize
+    || wssize(ZFMT, &zwssize, &frag) != 0)
+        return -1;
+    InitializeCriticalSection(&zlk);
+    zon = 1;
+    return 0;
+}
+
+static u32
+getu32(u8 *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static void
+putu32(u8 *p, u32 v)
+{
+    p[0] = (u8)v;
+    p[1] = (u8)(v >> 8);
+    p[2] = (u8)(v >> 16);
+    p[3] = (u8)(v >> 24);
+}
+
+static int
+readn(SOCKET s, u8 *p, u32 n)
+{
+    int r;
+
+    while(n > 0) {
+        r = recv(s, (char *)p, n, 0);
+        if(r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int
+writen(SOCKET s, u8 *p, u32 n)
+{
+    int r;
+
+    while(n > 0) {
+        r = send(s, (char *)p, n, 0);
+        if(r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int
+grow(u8 **bp, u32 *szp, u32 n)
+{
+    u8 *b;
+
+    if(n <= *szp)
+        return 0;
+    b = realloc(*bp, n);
+    if(!b)
+        return -1;
+    *bp = b;
+    *szp = n;
+    return 0;
+}
+
+// Compress the n byte message m into out, returning the compressed
+// size or 0 if it should be sent as is.  Small messages aren't worth
+// it, and a trial on a sample of large ones keeps data that is
+// already compressed from being compressed again.
+static ULONG
+zpack(u8 *m, u32 n, u8 *out, void *ws)
+{
+    ULONG sz;
+
+    if(n < ZMIN)
+        return 0;
+    if(n > 2 * ZSAMPLE
+    && (rtlCompress(ZFMT, m, ZSAMPLE, out, ZSAMPLE, ZCHUNK, &sz, ws) != 0
+        || sz > ZSAMPLE - ZSAMPLE / 8))
+        return 0;
+    if(rtlCompress(ZFMT, m, n, out, n, ZCHUNK, &sz, ws) != 0
+    || sz > n - n / 8)
+        return 0;
+    return sz;
+}
+
+static void
+zcount(u32 raw, u32 wire, int packed, LONGLONG ticks)
+{
+    EnterCriticalSection(&zlk);
+    zraw += raw;
+    zwire += wire + ZHDRSZ;
+    zmsgs++;
+    if(packed)
+        zpacked++;
+    zticks += ticks;
+    LeaveCriticalSection(&zlk);
+}
+
+static DWORD WINAPI
+zpumpProc(LPVOID arg)
+{
+    Zpump *p = arg;
+    Zconn *c = p->c;
+    LARGE_INTEGER t0, t1;
+    u8 hdr[ZHDRSZ], *buf, *zbuf, *out;
+    u32 bufsz, zbufsz, n, wn;
+    ULONG got;
+    void *ws;
+    int packed;
+
+    buf = zbuf = NULL;
+    bufsz = zbufsz = 0;
+    ws = malloc(zwssize);
+    while(ws) {
+        if(p->pack) {
+            if(readn(c->raw, hdr, 4) < 0)
+                break;
+            n = getu32(hdr);
+            if(n < 7 || n > ZMAXMSG
+            || grow(&buf, &bufsz, n) < 0 || grow(&zbuf, &zbufsz, n) < 0)
+                break;
+            memcpy(buf, hdr, 4);
+            if(readn(c->raw, buf + 4, n - 4) < 0)
+                break;
+            QueryPerformanceCounter(&t0);
+            wn = zpack(buf, n, zbuf, ws);
+            QueryPerformanceCounter(&t1);
+            packed = wn != 0;
+            if(!packed)
+                wn = n;
+            out = packed ? zbuf : buf;
+            putu32(hdr, packed ? wn | ZFLAG : wn);
+            putu32(hdr + 4, n);
+            if(writen(c->z, hdr, ZHDRSZ) < 0 || writen(c->z, out, wn) < 0)
+                break;
+        } else {
+            if(readn(c->z, hdr, ZHDRSZ) < 0)
+                break;
+            wn = getu32(hdr) & ~ZFLAG;
+            n = getu32(hdr + 4);
+            if(wn == 0 || wn > ZMAXMSG || n > ZMAXMSG
+            || grow(&buf, &bufsz, n) < 0 || grow(&zbuf, &zbufsz, wn) < 0)
+                break;
+            if(readn(c->z, zbuf, wn) < 0)
+                break;
+            QueryPerformanceCounter(&t0);
+            out = zbuf;
+            packed = (getu32(hdr) & ZFLAG) != 0;
+            if(packed) {
+                if(rtlDecompress(ZFMT, buf, n, zbuf, wn, &got) != 0 || got != n)
+                    break;
+                out = buf;
+            } else if(wn != n) {
+                break;
+            }
+            QueryPerformanceCounter(&t1);
+            if(writen(c->raw, out, n) < 0)
+                break;
+        }
+        zcount(n, wn, packed, t1.QuadPart - t0.QuadPart);
+    }
+    free(ws);
+    free(buf);
+    free(zbuf);
+
+    shutdown(c->raw, SD_BOTH);
+    shutdown(c->z, SD_BOTH);
+    if(InterlockedDecrement(&c->ref) == 0) {
+        closesocket(c->raw);
+        closesocket(c->z);
+        free(c);
+    }
+    free(p);
+    return 0;
+}
+
+// Relay between raw and z until either side closes.
+static void
+zstart(SOCKET raw, SOCKET z)
+{
+    Zconn *c;
+    Zpump *p;
+    HANDLE h;
+    int i, one;
+
+    c = malloc(sizeof *c);
+    if(!c) {
+        closesocket(raw);
+        closesocket(z);
+        return;
+    }
+    // frames go out as a header and a body; don't let Nagle hold
+    // the body back waiting for the header's ack.
+    one = 1;
+    setsockopt(raw, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof one);
+    setsockopt(z, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof one);
+    c->raw = raw;
+    c->z = z;
+    c->ref = 2;
+    for(i = 0; i < 2; i++) {
+        p = malloc(sizeof *p);
+        h = NULL;
+        if(p) {
+            p->c = c;
+            p->pack = i;
+            h = CreateThread(NULL, 0, zpumpProc, p, 0, NULL);
+        }
+        if(h) {
+            CloseHandle(h);
+            continue;
+        }
+        free(p);
+        shutdown(raw, SD_BOTH);
+        shutdown(z, SD_BOTH);
+        if(InterlockedDecrement(&c->ref) == 0) {
+            closesocket(raw);
+            closesocket(z);
+            free(c);
+        }
+    }
+}
+
+static SOCKET
+zdial(char *addr)
+{
+    struct addrinfo *list, *ai;
+    SOCKET s;
+
+    list = npc_netaddr(addr, 564);
+    s = INVALID_SOCKET;
+    for(ai = list; ai; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(s == INVALID_SOCKET)
+            continue;
+        if(connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0)
+            break;
+        closesocket(s);
+        s = INVALID_SOCKET;
+    }
+    if(list)
+        freeaddrinfo(list);
+    return s;
+}
+
+static SOCKET
+zlisten(u32 addr, int port)
+{
+    struct sockaddr_in sin;
+    SOCKET s;
+
+    s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(s == INVALID_SOCKET)
+        return s;
+    memset(&sin, 0, sizeof sin);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(addr);
+    sin.sin_port = htons((u16)port);
+    if(bind(s, (struct sockaddr *)&sin, sizeof sin) != 0
+    || listen(s, SOMAXCONN) != 0) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+// Accept connections on r->l and relay each to r->addr.  The client
+// end accepts plain connections from npclient and dials the framed
+// side; the server end does the opposite.
+static void
+zserve(Zrelay *r)
+{
+    SOCKET a, d;
+
+    for(;;) {
+        a = accept(r->l, NULL, NULL);
+        if(a == INVALID_SOCKET) {
+            Sleep(100);
+            continue;
+        }
+        d = zdial(r->addr);
+        if(d == INVALID_SOCKET) {
+            if(debug)
+                fprintf(stderr, "relay: cannot dial %s\n", r->addr);
+            closesocket(a);
+            continue;
+        }
+        if(r->client)
+            zstart(a, d);
+        else
+            zstart(d, a);
+    }
+}
+
+static DWORD WINAPI
+zserveProc(LPVOID arg)
+{
+    zserve(arg);
+    return 0;
+}
+
+// Start the client end of a relay to the compressed server at addr
+// and return the address npclient should mount instead.
+static char *
+zclient(char *addr)
+{
+    static char laddr[32];
+    struct sockaddr_in sin;
+    Zrelay *r;
+    HANDLE h;
+    int len;
+
+    if(!zon && zinit() < 0)
+        return NULL;
+    r = malloc(sizeof *r);
+    if(!r)
+        return NULL;
+    r->l = zlisten(INADDR_LOOPBACK, 0);
+    r->addr = addr;
+    r->client = 1;
+    len = sizeof sin;
+    if(r->l == INVALID_SOCKET
+    || getsockname(r->l, (struct sockaddr *)&sin, &len) != 0
+    || (h = CreateThread(NULL, 0, zserveProc, r, 0, NULL)) == NULL) {
+        if(r->l != INVALID_SOCKET)
+            closesocket(r->l);
+        free(r);
+        return NULL;
+    }
+    CloseHandle(h);
+    sprintf(laddr, "tcp!127.0.0.1!%d", ntohs(sin.sin_port));
+    return laddr;
+}
+
+// Statistics.  With -s the main operations are timed into log2
+// histograms of microseconds, and every statsecs seconds a summary
+// is printed along with the number of open fids and the process's
+// private memory, so that leaks and slowdowns under load show up.
+#define NBUCKET     32
+
+enum {
+    OpCreate, OpOpendir, OpClose, OpRead, OpWrite, OpFlush,
+    OpStat, OpFind, OpDelete, OpMove, NOPS
+};
+
+static char *opnames[NOPS] = {
+    "create", "opendir", "close", "read", "write", "flush",
+    "stat", "find", "delete", "move",
+};
+
+typedef struct Opstat Opstat;
+
+struct Opstat {
+    long n, errs;
+    LONGLONG us, max;
+    long hist[NBUCKET];     // hist[b] counts times under 2^b us
+};
+
+static CRITICAL_SECTION statlk;
+static Opstat opstats[NOPS];
+static int statsecs = 0;
+static LARGE_INTEGER qpf;
+static DWORD tstart;
+static SIZE_T mstart;
+
+static SIZE_T
+privBytes(void)
+{
+    PROCESS_MEMORY_COUNTERS pmc;
+
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof pmc))
+        return 0;
+    return pmc.PagefileUsage;
+}
+
+static LONGLONG
+opBegin(void)
+{
+    LARGE_INTEGER t;
+
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+static int
+opEnd(int op, LONGLONG t0, int r)
+{
+    LARGE_INTEGER t;
+    LONGLONG us;
+    Opstat *o;
+    int b;
+
+    QueryPerformanceCounter(&t);
+    us = (t.QuadPart - t0) * 1000000 / qpf.QuadPart;
+    for(b = 0; b < NBUCKET - 1 && ((LONGLONG)1 << b) <= us; b++)
+        ;
+    EnterCriticalSection(&statlk);
+    o = &opstats[op];
+    o->n++;
+    if(r)
+        o->errs++;
+    o->us += us;
+    if(us > o->max)
+        o->max = us;
+    o->hist[b]++;
+    LeaveCriticalSection(&statlk);
+    return r;
+}
+
+// Upper bound on the q quantile of o in microseconds.
+static LONGLONG
+quantile(Opstat *o, double q)
+{
+    long want, tot;
+    int b;
+
+    want = (long)(o->n * q);
+    for(tot = 0, b = 0; b < NBUCKET; b++) {
+        tot += o->hist[b];
+        if(tot > want)
+            break;
+    }
+    if(b == NBUCKET || ((LONGLONG)1 << b) > o->max)
+        return o->max;
+    return (LONGLONG)1 << b;
+}
+
+static void flushPrint(void);
+
+static void
+statsPrint(void)
+{
+    static DWORD tlast;
+    static long nlast;
+    Opstat o[NOPS];
+    DWORD now, dt;
+    SIZE_T mem;
+    long n;
+    int i;
+
+    EnterCriticalSection(&statlk);
+    memcpy(o, opstats, sizeof o);
+    LeaveCriticalSection(&statlk);
+    now = GetTickCount();
+    if(!tlast)
+        tlast = tstart;
+    dt = now - tlast;
+    for(n = 0, i = 0; i < NOPS; i++)
+        n += o[i].n;
+    mem = privBytes();
+
+    fprintf(stderr, "stats %lus: %ld ops, %.1f ops/s, %ld fids, %luK private (%+ldK), %d cached, %ld reconnects\n",
+        (now - tstart) / 1000, n, dt ? (n - nlast) * 1000.0 / dt : 0.0,
+        nfids, (unsigned long)(mem / 1024), (long)(mem - mstart) / 1024, ncent,
+        nreconnects);
+    for(i = 0; i < NOPS; i++) {
+        if(!o[i].n)
+            continue;
+        fprintf(stderr, "  %-8s %8ld ops %6ld errs  avg %6I64dus  p50 %6I64dus  p99 %6I64dus  p999 %6I64dus  max %6I64dus\n",
+            opnames[i], o[i].n, o[i].errs, o[i].us / o[i].n,
+            quantile(&o[i], 0.5), quantile(&o[i], 0.99),
+            quantile(&o[i], 0.999), o[i].max);
+    }
+    if(pfwake)
+        fprintf(stderr, "  prefetch %ld dirs, %ld entries, %ld hits, %ld dropped\n",
+            pfdirs, pfents, pfhits, pfdrops);
+    flushPrint();
+    if(zon) {
+        EnterCriticalSection(&zlk);
+        fprintf(stderr, "  relay %I64u bytes as %I64u on the wire (%.0f%%), %I64u of %I64u msgs compressed, %.1fms cpu\n",
+            zraw, zwire, zraw ? zwire * 100.0 / zraw : 100.0,
+            zpacked, zmsgs, zticks * 1000.0 / qpf.QuadPart);
+        LeaveCriticalSection(&zlk);
+    }
+    fflush(stderr);
+    tlast = now;
+    nlast = n;
+}
+
+static DWORD WINAPI
+statsProc(LPVOID arg)
+{
+    for(;;) {
+        Sleep(statsecs * 1000);
+        statsPrint();
+    }
+    return 0;
+}
+
+static void
+statsInit(void)
+{
+    HANDLE h;
+
+    InitializeCriticalSection(&statlk);
+    QueryPerformanceFrequency(&qpf);
+    tstart = GetTickCount();
+    mstart = privBytes();
+    if(statsecs > 0) {
+        h = CreateThread(NULL, 0, statsProc, NULL, 0, NULL);
+        if(h)
+            CloseHandle(h);
+    }
+}
+
+// Cache warm-up.  Every directory in a subtree is listed as its own
+// job on the I/O engine, so the whole tree is loaded into the cache
+// with as many requests outstanding as there are engine threads.
+#define WARMTTL     300000
+
+typedef struct Warm Warm;
+typedef struct Walk Walk;
+
+struct Warm {
+    Batch b;
+    int par;
+    CRITICAL_SECTION lk;
+    long dirs, ents, errs;
+    u64 bytes;
+};
+
+struct Walk {
+    Job job;
+    Warm *w;
+    char *path;
+};
+
+static void walkDir(Warm *w, char *path);
+
+static void
+walkProc(Job *j)
+{
+    Walk *k = (Walk *)j;
+
+    walkDir(k->w, k->path);
+    free(k->path);
+    free(k);
+}
+
+static void
+walkDir(Warm *w, char *path)
+{
+    Npwstat *st;
+    Walk *k;
+    u64 bytes;
+    char *cp;
+    int n, i, e;
+
+    bytes = 0;
+    e = listDir(path, &st, &n);
+    if(!e) {
+        cachePutDir(path, st, n, 0);
+        for(i = 0; i < n; i++) {
+            if(!st[i].name[0])
+                continue;
+            if(!(st[i].qid.type & Qtdir)) {
+                bytes += st[i].length;
+                continue;
+            }
+            cp = pathJoin(path, st[i].name);
+            if(!cp)
+                continue;
+            if(!w->par || (k = malloc(sizeof *k)) == NULL) {
+                walkDir(w, cp);
+                free(cp);
+                continue;
+            }
+            k->job.fn = walkProc;
+            k->w = w;
+            k->path = cp;
+            submit(&k->job, &w->b);
+        }
+        free(st);
+    }
+
+    EnterCriticalSection(&w->lk);
+    if(e) {
+        w->errs++;
+    } else {
+        w->dirs++;
+        w->ents += n;
+        w->bytes += bytes;
+    }
+    LeaveCriticalSection(&w->lk);
+    if(e && debug)
+        fprintf(stderr, "warm: cannot list %s\n", path);
+}
+
+// Load the attributes and listings of everything under path into
+// the cache and report what it took.
+static int
+warm(char *path)
+{
+    Npwstat *st;
+    Warm w;
+    DWORD t0;
+    char *fn;
+    int i;
+
+    fn = malloc(strlen(path) + 2);
+    if(!fn)
+        return -1;
+    sprintf(fn, "%s%s", path[0] == '/' || path[0] == '\\' ? "" : "/", path);
+    for(i = 0; fn[i]; i++)
+        if(fn[i] == '\\')
+            fn[i] = '/';
+    while(i > 1 && fn[i - 1] == '/')
+        fn[--i] = 0;
+
+    t0 = GetTickCount();
+    st = fsStat(fn);
+    if(!st) {
+        char *emsg;
+        int eno;
+
+        np_rerror(&emsg, &eno);
+        fprintf(stderr, "warm %s: (%d) %s\n", fn, eno, emsg);
+        free(fn);
+        return -1;
+    }
+    cachePutStat(fn, st, 0);
+    free(st);
+
+    // unless told otherwise, let the cache hold the whole tree and
+    // then leave it room to grow.
+    if(!cachefixed) {
+        EnterCriticalSection(&cachelk);
+        cachemax = INT_MAX;
+        LeaveCriticalSection(&cachelk);
+    }
+    memset(&w, 0, sizeof w);
+    InitializeCriticalSection(&w.lk);
+    w.b.pending = 1;
+    if(ioport)
+        w.b.done = CreateEvent(NULL, TRUE, FALSE, NULL);
+    w.par = w.b.done != NULL;
+    walkDir(&w, fn);
+    if(w.par) {
+        batchWait(&w.b);
+        CloseHandle(w.b.done);
+    }
+    DeleteCriticalSection(&w.lk);
+    if(!cachefixed) {
+        EnterCriticalSection(&cachelk);
+        cachemax = ncent + ncent / 4;
+        if(cachemax < CACHEMAX)
+            cachemax = CACHEMAX;
+        LeaveCriticalSection(&cachelk);
+    }
+
+    fprintf(stderr, "warm %s: %ld dirs, %ld entries, %I64u bytes, %ld errors in %.2fs\n",
+        fn, w.dirs, w.ents, w.bytes, w.errs, (GetTickCount() - t0) / 1000.0);
+    free(fn);
+    return 0;
+}
+
+// Write-back.  Writes that follow on from the last one are copied
+// into the handle's buffer and sent in one go, fanned out by the I/O
+// engine, when the buffer fills, when the handle is read, stat'ed,
+// truncated, flushed or closed, or when a write lands elsewhere.  An
+// error sending the buffer is returned by whichever of those sent it.
+#define WBMAX       (256 * 1024)
+
+// Send h's buffered writes.  Called with h->lk held.
+static int
+wbFlush(Handle *h)
+{
+    Npcfid *fid;
+    int r, e;
+
+    if(!h->wblen)
+        return 0;
+    fid = hFid(h);
+    fgEnter();
+    r = writeAll(fid, h->wb, h->wblen, h->wboff);
+    if(r < 0 && connLost(fid->fsys) && !(fid->qid.type & Qtappend)) {
+        fid = hFid(h);
+        r = writeAll(fid, h->wb, h->wblen, h->wboff);
+    }
+    fgLeave();
+    e = 0;
+    if(r < 0)
+        e = cvtError();
+    else if((u32)r != h->wblen)
+        e = -(int)ERROR_WRITE_FAULT;
+    h->wblen = 0;
+    cacheForgetStat(h->path);
+    return e;
+}
+
+static int
+wbSync(Handle *h)
+{
+    int e;
+
+    if(!h || !h->wback)
+        return 0;
+    EnterCriticalSection(&h->lk);
+    e = wbFlush(h);
+    LeaveCriticalSection(&h->lk);
+    return e;
+}
+
+// Buffer a write of n bytes at off on h.  Returns 0 if it was
+// buffered, 1 if it must be written through (after anything already
+// buffered has been sent), or an error.
+static int
+wbWrite(Handle *h, u8 *buf, u32 n, u64 off)
+{
+    int e;
+
+    e = 0;
+    EnterCriticalSection(&h->lk);
+    if(h->wblen && (off != h->wboff + h->wblen || h->wblen + n > WBMAX))
+        e = wbFlush(h);
+    if(!e && (n >= WBMAX || (!h->wb && (h->wb = malloc(WBMAX)) == NULL)))
+        e = 1;
+    if(!e) {
+        if(!h->wblen)
+            h->wboff = off;
+        memcpy(h->wb + h->wblen, buf, n);
+        h->wblen += n;
+    }
+    LeaveCriticalSection(&h->lk);
+    return e;
+}
+
+// Group commit.  FlushFileBuffers is turned into a sync wstat on the
+// file, which costs a walk and a wstat round trip; programs that flush
+// after every small write would otherwise wait on one of those each
+// time.  Flushes of a path are gathered into rounds: while one round's
+// sync is in flight, later flushes all join the next round, whose
+// first member sends a single sync for all of them once the current
+// one is done, and its result is handed to every member at once.  A
+// round that starts after a flush arrived always covers it.  Each
+// flusher sends its handle's write-back data before joining, which
+// overlaps the sync already in flight.
+#define NFGHASH     64
+#define FGMAX       1024
+#define FGSHOW      8
+
+typedef struct Fround Fround;
+typedef struct Fgroup Fgroup;
+
+struct Fround {
+    HANDLE ev;
+    int refs;
+    int err;
+};
+
+struct Fgroup {
+    Fgroup *next;
+    char *path;
+    u32 hash;
+    Fround *cur;        // sync in flight
+    Fround *wait;       // round waiting for cur
+    int refs;
+    long n, syncs;
+    LONGLONG us, max;
+};
+
+static CRITICAL_SECTION fglk;
+static Fgroup *fghash[NFGHASH];
+static int nfg = 0;
+static long fgn, fgsyncs;
+
+static void
+fgInit(void)
+{
+    InitializeCriticalSection(&fglk);
+}
+
+// Find the group for path, making it if need be and dropping an idle
+// group from the same chain if there are too many.  Called with fglk
+// held.
+static Fgroup *
+fglook(char *path)
+{
+    Fgroup *g, **l;
+    u32 h;
+
+    h = strHash(path);
+    for(g = fghash[h % NFGHASH]; g; g = g->next)
+        if(g->hash == h && strcmp(g->path, path) == 0)
+            return g;
+    if(nfg >= FGMAX) {
+        for(l = &fghash[h % NFGHASH]; (g = *l) != NULL; l = &g->next)
+            if(!g->refs)
+                break;
+        if(g) {
+            *l = g->next;
+            free(g->path);
+            free(g);
+            nfg--;
+        }
+    }
+    g = calloc(1, sizeof *g);
+    if(!g)
+        return NULL;
+    g->path = strdup(path);
+    if(!g->path) {
+        free(g);
+        return NULL;
+    }
+    g->hash = h;
+    g->next = fghash[h % NFGHASH];
+    fghash[h % NFGHASH] = g;
+    nfg++;
+    return g;
+}
+
+static Fround *
+newRound(void)
+{
+    Fround *r;
+
+    r = calloc(1, sizeof *r);
+    if(!r)
+        return NULL;
+    r->ev = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if(!r->ev) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Drop a reference to r.  Called with fglk held.
+static void
+putRound(Fround *r)
+{
+    if(--r->refs == 0) {
+        CloseHandle(r->ev);
+        free(r);
+    }
+}
+
+static int
+syncPath(char *path)
+{
+    Npwstat st;
+
+    npc_emptystat(&st);
+    if(fsWstat(path, &st, 1) < 0)
+        return cvtError();
+    return 0;
+}
+
+// Flush path, sharing the sync with any other flushes of it.
+static int
+groupFlush(char *path)
+{
+    Fgroup *g;
+    Fround *r, *prev;
+    LONGLONG t0, us;
+    int e, lead;
+
+    t0 = opBegin();
+    EnterCriticalSection(&fglk);
+    g = fglook(path);
+    if(!g) {
+        LeaveCriticalSection(&fglk);
+        return syncPath(path);
+    }
+    prev = NULL;
+    lead = 1;
+    if(!g->cur) {
+        r = g->cur = newRound();
+    } else if(!g->wait) {
+        r = g->wait = newRound();
+        prev = g->cur;
+    } else {
+        r = g->wait;
+        lead = 0;
+    }
+    if(!r) {
+        LeaveCriticalSection(&fglk);
+        return syncPath(path);
+    }
+    if(prev)
+        prev->refs++;
+    r->refs++;
+    g->refs++;
+    LeaveCriticalSection(&fglk);
+
+    if(prev) {
+        // the round in flight hands cur over to r when it is done.
+        WaitForSingleObject(prev->ev, INFINITE);
+        EnterCriticalSection(&fglk);
+        putRound(prev);
+        LeaveCriticalSection(&fglk);
+    }
+    if(lead) {
+        r->err = syncPath(path);
+        EnterCriticalSection(&fglk);
+        g->syncs++;
+        fgsyncs++;
+        g->cur = g->wait;
+        g->wait = NULL;
+        LeaveCriticalSection(&fglk);
+        SetEvent(r->ev);
+    } else {
+        WaitForSingleObject(r->ev, INFINITE);
+    }
+
+    EnterCriticalSection(&fglk);
+    e = r->err;
+    putRound(r);
+    us = (opBegin() - t0) * 1000000 / qpf.QuadPart;
+    g->refs--;
+    g->n++;
+    fgn++;
+    g->us += us;
+    if(us > g->max)
+        g->max = us;
+    LeaveCriticalSection(&fglk);
+    return e;
+}
+
+// Print the flush counters and the most flushed files.
+static void
+flushPrint(void)
+{
+    Fgroup *top[FGSHOW], *g;
+    int i, j, ntop;
+
+    EnterCriticalSection(&fglk);
+    if(!fgn) {
+        LeaveCriticalSection(&fglk);
+        return;
+    }
+    ntop = 0;
+    for(i = 0; i < NFGHASH; i++) {
+        for(g = fghash[i]; g; g = g->next) {
+            if(!g->n)
+                continue;
+            for(j = ntop; j > 0 && top[j - 1]->n < g->n; j--)
+                if(j < FGSHOW)
+                    top[j] = top[j - 1];
+            if(j < FGSHOW) {
+                top[j] = g;
+                if(ntop < FGSHOW)
+                    ntop++;
+            }
+        }
+    }
+    fprintf(stderr, "  flush    %ld flushes, %ld syncs, %ld coalesced\n",
+        fgn, fgsyncs, fgn - fgsyncs);
+    for(i = 0; i < ntop; i++) {
+        g = top[i];
+        fprintf(stderr, "    %6ld flushes %6ld syncs  avg %6I64dus  max %6I64dus  %s\n",
+            g->n, g->syncs, g->us / g->n, g->max, g->path);
+    }
+    LeaveCriticalSection(&fglk);
+}
+
+static int
+_CreateFile(
+    LPCWSTR                 FileName,
+    DWORD                   AccessMode,
+    DWORD                   ShareMode,
+    DWORD                   CreationDisposition,
+    DWORD                   FlagsAndAttributes,
+    PDOKAN_FILE_INFO        DokanFileInfo)
+{
+    Npcfid *fid = NULL;
+    Handle *h;
+    Npwstat st;
+    char *fn;
+    int omode, rd, wr, created;
+
+    if(debug)
+        fprintf(stderr, "createfile '%ws' create %d access %x flags %x\n", FileName, CreationDisposition, AccessMode, FlagsAndAttributes);
+    rd = (AccessMode & (GENERIC_READ | FILE_READ_DATA)) != 0;
+    wr = (AccessMode & (GENERIC_WRITE | FILE_WRITE_DATA)) != 0;
+    if(rd && wr)
+        omode = Ordwr;
+    else if(wr)
+        omode = Owrite;
+    else
+        omode = Oread;
+    if(CreationDisposition == TRUNCATE_EXISTING)
+        omode |= Otrunc;
+
+    fn = p9path(FileName);
+    if(!fn)
+        return -(int)ERROR_NOT_ENOUGH_MEMORY;
+
+    // opening an existing file only to read its attributes needs no
+    // fid when the cache has them, as in _OpenDirectory.
+    if(!rd && !wr && (CreationDisposition == OPEN_EXISTING ||
+                      CreationDisposition == OPEN_ALWAYS)
+    && cacheStat(fn, &st) == 0) {
+        free(fn);
+        DokanFileInfo->Context = 0;
+        return 0;
+    }
+
+    fgEnter();
+    fid = fidOpen(fn, omode);
+    created = 0;
+    if(!fid && (CreationDisposition == CREATE_ALWAYS || 
+                CreationDisposition == CREATE_NEW ||
+                CreationDisposition == OPEN_ALWAYS)) {
+        fid = fidCreate(fn, 0666, omode);
+        created = fid != NULL;
+    }
+    fgLeave();
+    if(created)
+        cacheForget(fn, 0);
+    else if(fid && (wr || CreationDisposition != OPEN_EXISTING))
+        cacheForgetStat(fn);
+    if(!fid) {
+        free(fn);
+        if(debug)
+            fprintf(stderr, "open %ws failed\n", FileName);
+        return cvtError();
+    }
+    h = newHandle(fid, fn, omode);
+    if(h && wr && (policy(fn)->flags & Pwriteback))
+        h->wback = 1;
+    free(fn);
+    if(!h) {
+        fidClose(fid);
+        return -(int)ERROR_NOT_ENOUGH_MEMORY;
+    }
+    DokanFileInfo->Context = (ULONG64)h;
+    return 0;
+}
+
+static int
+_CreateDirectory(
+    LPCWSTR                 FileName,
+    PDOKAN_FILE_INFO        DokanFileInfo)
+{
+    Npcfid *fid;
+    char *fn;
+    int perm;
+
+    if(debug)
+        fprintf(stderr, "create directory '%ws'\n", FileName);
+    fn = p9path(FileName);
+    perm = Dmdir | 0777; // XXX figure out perm
+    fid = fidCreate(fn, perm, Oread);
+    if(fid) {
+        fidClose(fid);
+        cacheForget(fn, 0);
+    }
+    free(fn);
+    if(!fid) {
+        if(debug)
+            fprintf(stderr, "create directory %ws failed\n", FileName);
+        return cvtError();
+    }
+    return 0;
+}
+
+static int
+_OpenDirectory(
+    LPCWSTR                 FileName,
+    PDOKAN_FILE_INFO        DokanFileInfo)
+{
+    Npcfid *fid = NULL;
+    Handle *h = NULL;
+    Npwstat st;
+    char *fn;
+    int e;
+
+    if(debug)
+        fprintf(stderr, "open directory '%ws'\n", FileName);
+    fn = p9path(FileName);
+    if(!fn)
+        return -(int)ERROR_NOT_ENOUGH_MEMORY;
+
+    // a directory known to the cache needs no fid; anything that
+    // uses the handle opens one for itself.
+    if(cacheStat(fn, &st) == 0 && (st.qid.type & Qtdir)) {
+        free(fn);
+        DokanFileInfo->Context = 0;
+        return 0;
+    }
+
+    e = 0;
+    fgEnter();
+    fid = fidOpen(fn, Oread);
+    fgLeave();
+    if(fid && !(fid->qid.type & Qtdir)) {
+        fidClose(fid);
+        fid = NULL;
+        e = -(int)ERROR_DIRECTORY; // XXX?
+    } else if(!fid) {
+        e = cvtError();
+    } else if((h = newHandle(fid, fn, Oread)) == NULL) {
+        fidClose(fid);
+        e = -(int)ERROR_NOT_ENOUGH_MEMORY;
+    }
+    free(fn);
+
+    if(e) {
+        if(debug)
+            fprintf(stderr, "diropen %ws failed\n", FileName);
+        return e;
+    }
+    DokanFileInfo->Context = (ULONG64)h;
+    return 0;
+}
+
+static int
+_CloseFile(
+    LPCWSTR                 FileName,
+    PDOKAN_FILE_INFO        DokanFileInfo)
+{
+    Handle *h = (Handle *)DokanFileInfo->Context;
+    int e;
+
+    e = 0;
+    if(h) {
+        DokanFileInfo->Context = 0;
+        e = wbSync(h);
+        freeHandle(h);
+    }
+    return e;
+}
+
+static int
+_Cleanup(
+    LPCWSTR                 FileName,
+    PDOKAN_FILE_INFO        DokanFileInfo)
+{
+    // XXX handle delete-on-close?
+    return _CloseFile(FileName, DokanFileInfo);
+}
+
+static int
+_ReadFile(
+    LPCWSTR             FileName,
+    LPVOID              Buffer,
+    DWORD               BufferLength,
+    LPDWORD             ReadLength,
+    LONGLONG            Offset,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    Handle *h = (Handle *)DokanFileInfo->Context;
+    Npcfid *fid;
+    int e, r, opened;
+
+    if(debug)
+        fprintf(stderr, "readfile\n");
+    e = wbSync(h);
+    if(e)
+        return e;
+    fid = hFid(h);
+    maybeOpen(FileName, Oread, &opened, &fid);
+    if(!fid)
+        return cvtError();
+    e = 0;
+    fgEnter();
+    r = readAll(fid, (u8*)Buffer, BufferLength, Offset);
+    if(r < 0 && connLost(fid->fsys)) {
+        maybeClose(&opened, &fid);
+        fid = hFid(h);
+        maybeOpen(FileName, Oread, &opened, &fid);
+        if(fid)
+            r = readAll(fid, (u8*)Buffer, BufferLength, Offset);
+    }
+    fgLeave();
+    if(r < 0)
+        e = cvtError();
+    maybeClose(&opened, &fid);
+    if(e) {
+        if(debug)
+            fprintf(stderr, "readfile error\n");
+        return e;
+    }
+    *ReadLength = r;
+    return 0;
+}
+
+static int
+_WriteFile(
+    LPCWSTR     FileName,
+    LPCVOID     Buffer,
+    DWORD       NumberOfBytesToWrite,
+    LPDWORD     NumberOfBytesWritten,
+    LONGLONG            Offset,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    Handle *h = (Handle *)DokanFileInfo->Context;
+    Npcfid *fid;
+    int e, r, opened;
+
+    if(debug)
+        fprintf(stderr, "writefile\n");
+    if(h && h->wback) {
+        e = wbWrite(h, (u8*)Buffer, NumberOfBytesToWrite, Offset);
+        if(e < 0)
+            return e;
+        if(e == 0) {
+            *NumberOfBytesWritten = NumberOfBytesToWrite;
+            return 0;
+        }
+    }
+    fid = hFid(h);
+    maybeOpen(FileName, Owrite, &opened, &fid);
+    if(!fid)
+        return cvtError();
+    e = 0;
+    fgEnter();
+    r = writeAll(fid, (u8*)Buffer, NumberOfBytesToWrite, Offset);
+    // a write to an append-only file may have been done already.
+    if(r < 0 && connLost(fid->fsys) && !(fid->qid.type & Qtappend)) {
+        maybeClose(&opened, &fid);
+        fid = hFid(h);
+        maybeOpen(FileName, Owrite, &opened, &fid);
+        if(fid)
+            r = writeAll(fid, (u8*)Buffer, NumberOfBytesToWrite, Offset);
+    }
+    fgLeave();
+    if(r > 0) {
+        if(h)
+            cacheForgetStat(h->path);
+        else
+            cacheForgetStatW(FileName);
+    }
+    if(r < 0)
+        e = cvtError();
+    maybeClose(&opened, &fid);
+    if(e) {
+        if(debug)
+            fprintf(stderr, "writefile error\n");
+        return e;
+    }
+    *NumberOfBytesWritten = r;
+    return 0;
+}
+
+static int
+_FlushFileBuffers(
+    LPCWSTR     FileName,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    char *fn;
+    int e;
+
+    if(debug)
+        fprintf(stderr, "flushfilebuffers '%ws'\n", FileName);
+    fn = p9path(FileName);
+    if(!fn)
+        return -(int)ERROR_NOT_ENOUGH_MEMORY;
+    e = wbSync((Handle *)DokanFileInfo->Context);
+    if(!e)
+        e = groupFlush(fn);
+    free(fn);
+    if(e) {
+        if(debug)
+            fprintf(stderr, "flushfilebuffers error\n");
+        return e;
+    }
+    return 0;
+}
+
+static int
+_GetFileInformation(
+    LPCWSTR                         FileName,
+    LPBY_HANDLE_FILE_INFORMATION    fi,
+    PDOKAN_FILE_INFO                DokanFileInfo)
+{
+    Npwstat *st = NULL;
+    Npwstat cst;
+    char *fn;
+    int e;
+
+    if(debug)
+        fprintf(stderr, "getfileinfo '%ws'\n", FileName);
+    e = wbSync((Handle *)DokanFileInfo->Context);
+    if(e)
+        return e;
+    fn = p9path(FileName);
+    if(!fn)
+        return -(int)ERROR_NOT_ENOUGH_MEMORY;
+    if(cacheStat(fn, &cst) == 0) {
+        toFileInfo(&cst, fi);
+        free(fn);
+        return 0;
+    }
+    e = 0;
+    fgEnter();
+    st = fsStat(fn);
+    fgLeave();
+    if(st) {
+        toFileInfo(st, fi);
+        cachePutStat(fn, st, 0);
+        free(st);
+    } else {
+        e = cvtError();
+    }
+    free(fn);
+    if(e) {
         if(debug)
-            fprintf(stderr, "open %ws failed\n", FileName);
-        return cvtError();
+            fprintf(stderr, "getfileinfo error\n");
+        return e;
     }
-    DokanFileInfo->Context = (ULONG64)fid;
     return 0;
 }
 
 static int
-_CreateDirectory(
-    LPCWSTR                 FileName,
-    PDOKAN_FILE_INFO        DokanFileInfo)
+_FindFiles(
+    LPCWSTR             FileName,
+    PFillFindData       FillFindData, // function pointer
+    PDOKAN_FILE_INFO    DokanFileInfo)
 {
-    Npcfid *fid;
+    Npwstat *st;
+    WIN32_FIND_DATA findData;
     char *fn;
-    int perm;
+    int cnt, i, e;
 
     if(debug)
-        fprintf(stderr, "create directory '%ws'\n", FileName);
+        fprintf(stderr, "findfiles '%ws'\n", FileName);
     fn = p9path(FileName);
-    perm = Dmdir | 0777; // XXX figure out perm
-    fid = npc_create(fs, fn, perm, Oread);
-    if(fid)
-        npc_close(fid);
+    if(!fn)
+        return -(int)ERROR_NOT_ENOUGH_MEMORY;
+    e = 0;
+    st = cacheDir(fn, &cnt);
+    if(!st) {
+        fgEnter();
+        e = listDir(fn, &st, &cnt);
+        fgLeave();
+        if(!e)
+            cachePutDir(fn, st, cnt, 0);
+    }
+    if(!e) {
+        for(i = 0; i < cnt; i++) {
+            if(!st[i].name[0])
+                continue;
+            if(toFindData(&st[i], &findData)) {
+                if(debug)
+                    fprintf(stderr, "findfiles error converting '%s'... eliding.\n", st[i].name);
+                continue;
+            }
+            FillFindData(&findData, DokanFileInfo);
+        }
+        prefetch(fn, st, cnt, 1, NULL);
+        free(st);
+    }
     free(fn);
-    if(!fid) {
+    if(e) {
         if(debug)
-            fprintf(stderr, "create directory %ws failed\n", FileName);
+            fprintf(stderr, "findfiles failed\n");
+        return e;
+    }
+    return 0;
+}
+
+static int
+_DeleteFile(
+    LPCWSTR             FileName,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    char *fn;
+    int r;
+
+    if(debug)
+        fprintf(stderr, "deletefile %ws\n", FileName);
+    fn = p9path(FileName);
+    if(!fn)
+        return -(int)ERROR_NOT_ENOUGH_MEMORY;
+    r = fsRemove(fn);
+    if(r >= 0)
+        cacheForget(fn, 1);
+    free(fn);
+    if(r < 0) {
+        if(debug)
+            fprintf(stderr, "deletefile %ws failed\n", FileName);
         return cvtError();
     }
     return 0;
 }
 
 static int
-_OpenDirectory(
+_DeleteDirectory(
+    LPCWSTR             FileName,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    return _DeleteFile(FileName, DokanFileInfo);
+}
+
+static int
+_MoveFile(
+    LPCWSTR             FileName, // existing file name
+    LPCWSTR             NewFileName,
+    BOOL                ReplaceIfExisting,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    Npwstat st;
+    char *fn, *fn2, *p, *newname;
+    int dirlen, r, e;
+
+    e = 0;
+    if(debug)
+        fprintf(stderr, "move %ws to %ws\n", FileName, NewFileName);
+    fn = p9path(FileName);
+    fn2 = p9path(NewFileName);
+    if(!fn || !fn2) {
+        e = -(int)ERROR_NOT_ENOUGH_MEMORY;
+        goto err;
+    }
+
+    p = strrchr(fn, '/');
+    if(p) {
+        dirlen = p - fn;
+        newname = fn2 + dirlen + 1;
+    } else {
+        dirlen = 0;
+        newname = fn2;
+    }
+    // same directory?
+    if(strncmp(fn, fn2, dirlen) != 0 || strchr(newname, '/') != NULL) {
+        // XXX better error?  cant move files between directories...
+        e = -(int)ERROR_NOT_SAME_DEVICE;
+        goto err;
+    }
+
+    npc_emptystat(&st);
+    st.name = newname;
+    r = fsWstat(fn, &st, 0);
+    if(r < 0) {
+        e = cvtError();
+        goto err; 
+    }
+    cacheForget(fn, 1);
+    cacheForget(fn2, 1);
+    /* fall through */
+
+err:
+    if(fn)
+        free(fn);
+    if(fn2)
+        free(fn2);
+    if(e) {
+        if(debug)
+            fprintf(stderr, "move failed\n");
+        return e;
+    }
+    return 0;
+}
+
+static int
+_LockFile(
+    LPCWSTR             FileName,
+    LONGLONG            ByteOffset,
+    LONGLONG            Length,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    // always fail; we dont do locking.
+    return -(int)ERROR_NOT_SUPPORTED;
+}
+
+static int
+_SetEndOfFile(
+    LPCWSTR             FileName,
+    LONGLONG            ByteOffset,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    Npwstat st;
+    char *fn;
+    int r;
+
+    r = wbSync((Handle *)DokanFileInfo->Context);
+    if(r)
+        return r;
+    fn = p9path(FileName);
+    if(!fn)
+        return -(int)ERROR_NOT_ENOUGH_MEMORY;
+    npc_emptystat(&st);
+    st.length = ByteOffset;
+    r = fsWstat(fn, &st, 1);
+    if(r >= 0)
+        cacheForgetStat(fn);
+    free(fn);
+    if(r < 0)
+        return cvtError();
+    return 0;
+}
+
+static int
+_SetAllocationSize(
+    LPCWSTR             FileName,
+    LONGLONG            AllocSize,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    // XXX what exactly is this?
+    return notyet("SetAllocationSize");
+}
+
+static int
+_SetFileAttributes(
+    LPCWSTR             FileName,
+    DWORD               FileAttributes,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    if(debug)
+        fprintf(stderr, "setfileattributes '%ws' %x\n", FileName, FileAttributes);
+    FileAttributes &= ~FILE_ATTRIBUTE_NORMAL;
+    if(FileAttributes) {
+        if(debug)
+            fprintf(stderr, "setfileattributes error (unsupported bits)\n");
+        return -(int)ERROR_NOT_SUPPORTED;
+    }
+    return 0;
+}
+
+
+static int
+_SetFileTime(
+    LPCWSTR             FileName,
+    CONST FILETIME*     CreationTime,
+    CONST FILETIME*     LastAccessTime,
+    CONST FILETIME*     LastWriteTime,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    Npwstat st;
+    char *fn;
+    int r;
+
+    if(!LastAccessTime && !LastWriteTime)
+        return 0;
+    fn = p9path(FileName);
+    if(!fn)
+        return -(int)ERROR_NOT_ENOUGH_MEMORY;
+    npc_emptystat(&st);
+    if(LastAccessTime)
+        st.atime = fromFT(LastAccessTime);
+    if(LastWriteTime)
+        st.mtime = fromFT(LastWriteTime);
+    r = fsWstat(fn, &st, 1);
+    if(r >= 0)
+        cacheForgetStat(fn);
+    free(fn);
+    if(r < 0)
+        return cvtError();
+    return 0;
+}
+
+static int
+_UnlockFile(
+    LPCWSTR             FileName,
+    LONGLONG            ByteOffset,
+    LONGLONG            Length,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    // always fail; we dont do locking.
+    return -(int)ERROR_NOT_SUPPORTED;
+}
+
+static int
+_Unmount(
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    if(debug)
+        fprintf(stderr, "unmount\n");
+    if(statsecs || (debug && (pfwake || zon)))
+        statsPrint();
+    npc_umount(connFs());
+    return 0;
+}
+
+// Timed versions of the callbacks, used with -s.
+static int
+sCreateFile(
     LPCWSTR                 FileName,
+    DWORD                   AccessMode,
+    DWORD                   ShareMode,
+    DWORD                   CreationDisposition,
+    DWORD                   FlagsAndAttributes,
     PDOKAN_FILE_INFO        DokanFileInfo)
 {
-    Npcfid *fid = NULL;
-    char *fn;
-    int e;
-
-    if(debug)
-        fprintf(stderr, "open directory '%ws'\n", FileName);
-    fn = p9path(FileName);
-    if(!fn)
-        return -(int)ERROR_NOT_ENOUGH_MEMORY;
-
-    e = 0;
-    fid = npc_open(fs, fn, Oread);
-    if(fid && !(fid->qid.type & Qtdir)) {
-        npc_close(fid);
-        fid = NULL;
-        e = -(int)ERROR_DIRECTORY; // XXX?
-    } else if(!fid) {
-        e = cvtError();
-    }
-    free(fn);
+    LONGLONG t = opBegin();
 
-    if(e) {
-        if(debug)
-            fprintf(stderr, "diropen %ws failed\n", FileName);
-        return e;
-    }
-    DokanFileInfo->Context = (ULONG64)fid;
-    return 0;
+    return opEnd(OpCreate, t, _CreateFile(FileName, AccessMode, ShareMode,
+        CreationDisposition, FlagsAndAttributes, DokanFileInfo));
 }
 
 static int
-_CloseFile(
+sOpenDirectory(
     LPCWSTR                 FileName,
     PDOKAN_FILE_INFO        DokanFileInfo)
 {
-    Npcfid *fid = (Npcfid *)DokanFileInfo->Context;
+    LONGLONG t = opBegin();
 
-    if(fid) {
-        DokanFileInfo->Context = 0;
-        npc_close(fid);
-    }
-    return 0;
+    return opEnd(OpOpendir, t, _OpenDirectory(FileName, DokanFileInfo));
 }
 
 static int
-_Cleanup(
+sCleanup(
     LPCWSTR                 FileName,
     PDOKAN_FILE_INFO        DokanFileInfo)
 {
-    // XXX handle delete-on-close?
-    return _CloseFile(FileName, DokanFileInfo);
+    LONGLONG t = opBegin();
+
+    return opEnd(OpClose, t, _Cleanup(FileName, DokanFileInfo));
 }
 
 static int
-_ReadFile(
+sReadFile(
     LPCWSTR             FileName,
     LPVOID              Buffer,
     DWORD               BufferLength,
@@ -422,30 +3501,14 @@ _ReadFile(
     LONGLONG            Offset,
     PDOKAN_FILE_INFO    DokanFileInfo)
 {
-    Npcfid *fid = (Npcfid *)DokanFileInfo->Context;
-    int e, r, opened;
+    LONGLONG t = opBegin();
 
-    if(debug)
-        fprintf(stderr, "readfile\n");
-    maybeOpen(FileName, Oread, &opened, &fid);
-    if(!fid)
-        return cvtError();
-    e = 0;
-    r = npc_read(fid, Buffer, BufferLength, Offset);
-    if(r < 0)
-        e = cvtError();
-    maybeClose(&opened, &fid);
-    if(e) {
-        if(debug)
-            fprintf(stderr, "readfile error\n");
-        return e;
-    }
-    *ReadLength = r;
-    return 0;
+    return opEnd(OpRead, t, _ReadFile(FileName, Buffer, BufferLength,
+        ReadLength, Offset, DokanFileInfo));
 }
 
 static int
-_WriteFile(
+sWriteFile(
     LPCWSTR     FileName,
     LPCVOID     Buffer,
     DWORD       NumberOfBytesToWrite,
@@ -453,350 +3516,1044 @@ _WriteFile(
     LONGLONG            Offset,
     PDOKAN_FILE_INFO    DokanFileInfo)
 {
-    Npcfid *fid = (Npcfid *)DokanFileInfo->Context;
-    int e, r, opened;
+    LONGLONG t = opBegin();
 
-    if(debug)
-        fprintf(stderr, "writefile\n");
-    maybeOpen(FileName, Owrite, &opened, &fid);
-    if(!fid)
-        return cvtError();
-    e = 0;
-    r = npc_write(fid, (u8*)Buffer, NumberOfBytesToWrite, Offset);
-    if(r < 0)
-        e = cvtError();
-    maybeClose(&opened, &fid);
-    if(e) {
-        if(debug)
-            fprintf(stderr, "writefile error\n");
-        return e;
-    }
-    *NumberOfBytesWritten = r;
-    return 0;
+    return opEnd(OpWrite, t, _WriteFile(FileName, Buffer, NumberOfBytesToWrite,
+        NumberOfBytesWritten, Offset, DokanFileInfo));
 }
 
 static int
-_FlushFileBuffers(
+sFlushFileBuffers(
     LPCWSTR     FileName,
     PDOKAN_FILE_INFO    DokanFileInfo)
 {
-    Npwstat st;
-    char *fn;
-    int e, r;
+    LONGLONG t = opBegin();
 
-    if(debug)
-        fprintf(stderr, "flushfilebuffers '%ws'\n", FileName);
-    fn = p9path(FileName);
-    npc_emptystat(&st);
-    e = 0;
-    r = npc_wstat(fs, fn, &st);
-    if(r < 0)
-        e = cvtError();
-    free(fn);
-    if(e) {
-        if(debug)
-            fprintf(stderr, "flushfilebuffers error\n");
-        return e;
-    }
-    return 0;
+    return opEnd(OpFlush, t, _FlushFileBuffers(FileName, DokanFileInfo));
 }
 
 static int
-_GetFileInformation(
+sGetFileInformation(
     LPCWSTR                         FileName,
     LPBY_HANDLE_FILE_INFORMATION    fi,
     PDOKAN_FILE_INFO                DokanFileInfo)
 {
-    Npwstat *st = NULL;
-    char *fn;
-    int e;
+    LONGLONG t = opBegin();
 
-    if(debug)
-        fprintf(stderr, "getfileinfo '%ws'\n", FileName);
-    fn = p9path(FileName);
-    if(!fn)
-        return -(int)ERROR_NOT_ENOUGH_MEMORY;
-    e = 0;
-    st = npc_stat(fs, fn);
-    if(st) {
-        toFileInfo(st, fi);
-        free(st);
-    } else {
-        e = cvtError();
-    }
-    free(fn);
-    if(e) {
-        if(debug)
-            fprintf(stderr, "getfileinfo error\n");
-        return e;
-    }
-    return 0;
+    return opEnd(OpStat, t, _GetFileInformation(FileName, fi, DokanFileInfo));
 }
 
 static int
-_FindFiles(
+sFindFiles(
     LPCWSTR             FileName,
-    PFillFindData       FillFindData, // function pointer
+    PFillFindData       FillFindData,
     PDOKAN_FILE_INFO    DokanFileInfo)
 {
-    Npwstat *st;
-    WIN32_FIND_DATA findData;
-    Npcfid *fid = NULL;
-    char *fn;
-    int cnt, i, e;
+    LONGLONG t = opBegin();
 
-    if(debug)
-        fprintf(stderr, "findfiles '%ws'\n", FileName);
-    fn = p9path(FileName);
-    if(!fn)
-        return -(int)ERROR_NOT_ENOUGH_MEMORY;
-    e = 0;
-    fid = npc_open(fs, fn, Oread);
-    if(!fid)
-        e = cvtError();
-    while(fid) {
-        cnt = npc_dirread(fid, &st);
-        if(cnt == 0)
+    return opEnd(OpFind, t, _FindFiles(FileName, FillFindData, DokanFileInfo));
+}
+
+static int
+sDeleteFile(
+    LPCWSTR             FileName,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    LONGLONG t = opBegin();
+
+    return opEnd(OpDelete, t, _DeleteFile(FileName, DokanFileInfo));
+}
+
+static int
+sMoveFile(
+    LPCWSTR             FileName,
+    LPCWSTR             NewFileName,
+    BOOL                ReplaceIfExisting,
+    PDOKAN_FILE_INFO    DokanFileInfo)
+{
+    LONGLONG t = opBegin();
+
+    return opEnd(OpMove, t, _MoveFile(FileName, NewFileName,
+        ReplaceIfExisting, DokanFileInfo));
+}
+
+// Loopback server.  A small 9P2000 file server that keeps its tree
+// in memory, so the load test can run without a real server.  Each
+// connection is served by its own thread, one message at a time, and
+// a single lock covers the tree.  Files get a nonzero qid version
+// that changes as they are written, as stored files do.
+#define LSMSIZE     (64 * 1024 + IOHDRSZ)
+#define LSFMAX      (16 * 1024 * 1024)
+#define LSMAXWELEM  16
+#define NLSFID      64
+
+enum {
+    Lversion = 100, Lauth = 102, Lattach = 104, Lerror = 106,
+    Lflush = 108, Lwalk = 110, Lopen = 112, Lcreate = 114,
+    Lread = 116, Lwrite = 118, Lclunk = 120, Lremove = 122,
+    Lstat = 124, Lwstat = 126,
+};
+
+typedef struct Lnode Lnode;
+typedef struct Lfid Lfid;
+typedef struct Lconn Lconn;
+typedef struct Lbuf Lbuf;
+
+struct Lnode {
+    char *name;
+    Lnode *parent;
+    Lnode *kids;
+    Lnode *sib;
+    Npqid qid;
+    u32 mode;
+    u32 atime;
+    u32 mtime;
+    u8 *data;
+    u32 len;
+    u32 cap;
+    int ref;            // fids on it
+    int gone;           // removed from the tree
+};
+
+struct Lfid {
+    u32 fid;
+    Lnode *n;
+    int omode;          // -1 until opened
+    int didx;           // entries a directory read has returned
+    u64 doff;           // offset the next one is read at
+    Lfid *next;
+};
+
+struct Lconn {
+    SOCKET s;
+    u32 msize;
+    Lfid *fids[NLSFID];
+};
+
+struct Lbuf {
+    u8 *p;
+    u8 *e;
+    int bad;
+};
+
+static CRITICAL_SECTION lslk;
+static Lnode *lsroot;
+static u64 lsqpath;
+
+static u64
+lgetn(Lbuf *b, int n)
+{
+    u64 v;
+    int i;
+
+    if(b->e - b->p < n) {
+        b->bad = 1;
+        return 0;
+    }
+    for(v = 0, i = 0; i < n; i++)
+        v |= (u64)b->p[i] << (8 * i);
+    b->p += n;
+    return v;
+}
+
+// A copy of the next string in b, which the caller frees.
+static char *
+lgets(Lbuf *b)
+{
+    char *s;
+    u32 l;
+
+    l = (u32)lgetn(b, 2);
+    if(b->bad || (u32)(b->e - b->p) < l || (s = malloc(l + 1)) == NULL) {
+        b->bad = 1;
+        return NULL;
+    }
+    memcpy(s, b->p, l);
+    s[l] = 0;
+    b->p += l;
+    return s;
+}
+
+static void
+lputn(Lbuf *b, u64 v, int n)
+{
+    int i;
+
+    if(b->e - b->p < n) {
+        b->bad = 1;
+        return;
+    }
+    for(i = 0; i < n; i++)
+        b->p[i] = (u8)(v >> (8 * i));
+    b->p += n;
+}
+
+static void
+lputs(Lbuf *b, char *s)
+{
+    u32 l;
+
+    l = strlen(s);
+    lputn(b, l, 2);
+    if(b->bad || (u32)(b->e - b->p) < l) {
+        b->bad = 1;
+        return;
+    }
+    memcpy(b->p, s, l);
+    b->p += l;
+}
+
+static void
+lputq(Lbuf *b, Npqid *q)
+{
+    lputn(b, q->type, 1);
+    lputn(b, q->version, 4);
+    lputn(b, q->path, 8);
+}
+
+static void
+lputstat(Lbuf *b, Lnode *n)
+{
+    u8 *sp;
+
+    sp = b->p;
+    lputn(b, 0, 2);
+    lputn(b, 0, 2);
+    lputn(b, 0, 4);
+    lputq(b, &n->qid);
+    lputn(b, n->mode, 4);
+    lputn(b, n->atime, 4);
+    lputn(b, n->mtime, 4);
+    lputn(b, n->len, 8);
+    lputs(b, n->parent ? n->name : "/");
+    lputs(b, "load");
+    lputs(b, "load");
+    lputs(b, "load");
+    if(!b->bad) {
+        sp[0] = (u8)(b->p - sp - 2);
+        sp[1] = (u8)((b->p - sp - 2) >> 8);
+    }
+}
+
+static Lnode *
+lnode(Lnode *dir, char *name, u32 mode)
+{
+    Lnode *n;
+
+    n = calloc(1, sizeof *n);
+    if(!n || (n->name = strdup(name)) == NULL) {
+        free(n);
+        return NULL;
+    }
+    n->mode = mode;
+    n->qid.type = (mode & Dmdir) ? Qtdir : 0;
+    n->qid.version = 1;
+    n->qid.path = lsqpath++;
+    n->atime = n->mtime = (u32)time(NULL);
+    n->parent = dir;
+    if(dir) {
+        n->sib = dir->kids;
+        dir->kids = n;
+    }
+    return n;
+}
+
+static Lnode *
+lchild(Lnode *dir, char *name)
+{
+    Lnode *n;
+
+    for(n = dir->kids; n; n = n->sib)
+        if(strcmp(n->name, name) == 0)
             break;
-        if(cnt < 0) {
-            e = cvtError();
+    return n;
+}
+
+static void
+lunlink(Lnode *n)
+{
+    Lnode **l;
+
+    for(l = &n->parent->kids; *l != n; l = &(*l)->sib)
+        ;
+    *l = n->sib;
+    n->gone = 1;
+}
+
+static void
+lput(Lnode *n)
+{
+    if(--n->ref == 0 && n->gone) {
+        free(n->name);
+        free(n->data);
+        free(n);
+    }
+}
+
+static Lfid *
+lfid(Lconn *c, u32 fid)
+{
+    Lfid *f;
+
+    for(f = c->fids[fid % NLSFID]; f; f = f->next)
+        if(f->fid == fid)
             break;
+    return f;
+}
+
+static Lfid *
+lnewfid(Lconn *c, u32 fid, Lnode *n)
+{
+    Lfid *f;
+
+    f = calloc(1, sizeof *f);
+    if(!f)
+        return NULL;
+    f->fid = fid;
+    f->n = n;
+    f->omode = -1;
+    n->ref++;
+    f->next = c->fids[fid % NLSFID];
+    c->fids[fid % NLSFID] = f;
+    return f;
+}
+
+static void
+lfreefid(Lconn *c, Lfid *f)
+{
+    Lfid **l;
+
+    for(l = &c->fids[f->fid % NLSFID]; *l != f; l = &(*l)->next)
+        ;
+    *l = f->next;
+    lput(f->n);
+    free(f);
+}
+
+static int
+lsetlen(Lnode *n, u64 len)
+{
+    u8 *d;
+    u32 cap;
+
+    if(len > LSFMAX)
+        return -1;
+    if(len > n->cap) {
+        for(cap = n->cap ? n->cap : 4096; cap < len; cap *= 2)
+            ;
+        d = realloc(n->data, cap);
+        if(!d)
+            return -1;
+        memset(d + n->cap, 0, cap - n->cap);
+        n->data = d;
+        n->cap = cap;
+    }
+    if(len < n->len)
+        memset(n->data + len, 0, n->len - (u32)len);
+    n->len = (u32)len;
+    return 0;
+}
+
+// Handle the message of type t in m, putting the body of the reply
+// in r.  Returns an error string for an Rerror instead.
+static char *
+lrpc(Lconn *c, int t, Lbuf *m, Lbuf *r)
+{
+    char *name, *names[LSMAXWELEM], *ver, *s1, *s2, *err;
+    Npqid qids[LSMAXWELEM];
+    Lnode *n, *nn;
+    Lfid *f;
+    u8 *cp, *ep, *sp;
+    u64 off, len;
+    u32 fid, newfid, count, perm, mode, atime, mtime;
+    int i, j, nw, omode;
+
+    err = NULL;
+    fid = 0;
+    f = NULL;
+    if(t != Lversion && t != Lflush) {
+        fid = (u32)lgetn(m, 4);
+        f = lfid(c, fid);
+    }
+    switch(t) {
+    case Lversion:
+        count = (u32)lgetn(m, 4);
+        ver = lgets(m);
+        if(!ver)
+            return "bad message";
+        if(count < c->msize)
+            c->msize = count;
+        for(i = 0; i < NLSFID; i++)
+            while(c->fids[i])
+                lfreefid(c, c->fids[i]);
+        lputn(r, c->msize, 4);
+        lputs(r, strncmp(ver, "9P2000", 6) == 0 ? "9P2000" : "unknown");
+        free(ver);
+        break;
+    case Lauth:
+        return "authentication not required";
+    case Lattach:
+        lgetn(m, 4);
+        s1 = lgets(m);
+        s2 = lgets(m);
+        free(s1);
+        free(s2);
+        if(m->bad)
+            return "bad message";
+        if(f)
+            return "fid in use";
+        if(!lnewfid(c, fid, lsroot))
+            return "out of memory";
+        lputq(r, &lsroot->qid);
+        break;
+    case Lflush:
+        break;
+    case Lwalk:
+        newfid = (u32)lgetn(m, 4);
+        nw = (int)lgetn(m, 2);
+        if(m->bad || nw > LSMAXWELEM)
+            return "bad message";
+        if(!f)
+            return "unknown fid";
+        if(f->omode >= 0)
+            return "fid open";
+        if(newfid != fid && lfid(c, newfid))
+            return "fid in use";
+        for(i = 0; i < nw; i++)
+            names[i] = lgets(m);
+        n = f->n;
+        for(i = 0; i < nw && !m->bad; i++) {
+            if(!(n->qid.type & Qtdir))
+                break;
+            if(strcmp(names[i], "..") == 0)
+                nn = n->parent ? n->parent : n;
+            else
+                nn = lchild(n, names[i]);
+            if(!nn)
+                break;
+            qids[i] = nn->qid;
+            n = nn;
         }
-        for(i = 0; i < cnt; i++) {
-            if(!st[i].name[0])
-                continue;
-            e = toFindData(&st[i], &findData);
-            if(e) {
-                if(debug)
-                    fprintf(stderr, "findfiles error converting '%s'... eliding.\n", st[i].name);
-                continue;
+        for(j = 0; j < nw; j++)
+            free(names[j]);
+        if(m->bad)
+            return "bad message";
+        if(i == 0 && nw > 0)
+            return "file not found";
+        if(i == nw) {
+            if(newfid == fid) {
+                n->ref++;
+                lput(f->n);
+                f->n = n;
+            } else if(!lnewfid(c, newfid, n)) {
+                return "out of memory";
+            }
+        }
+        lputn(r, i, 2);
+        for(j = 0; j < i; j++)
+            lputq(r, &qids[j]);
+        break;
+    case Lopen:
+    case Lcreate:
+        name = NULL;
+        perm = 0;
+        if(t == Lcreate) {
+            name = lgets(m);
+            perm = (u32)lgetn(m, 4);
+        }
+        omode = (int)lgetn(m, 1);
+        if(m->bad) {
+            free(name);
+            return "bad message";
+        }
+        n = f ? f->n : NULL;
+        if(!f)
+            err = "unknown fid";
+        else if(f->omode >= 0)
+            err = "fid already open";
+        else if(n->gone)
+            err = "file removed";
+        else if(t == Lcreate && !(n->qid.type & Qtdir))
+            err = "not a directory";
+        else if(t == Lcreate && (!name[0] || strcmp(name, ".") == 0
+            || strcmp(name, "..") == 0 || strchr(name, '/')))
+            err = "bad file name";
+        else if(t == Lcreate && lchild(n, name))
+            err = "file exists";
+        if(!err && t == Lcreate) {
+            nn = lnode(n, name, perm & (Dmdir | 0777));
+            if(!nn) {
+                err = "out of memory";
+            } else {
+                nn->ref++;
+                lput(n);
+                f->n = n = nn;
             }
-            FillFindData(&findData, DokanFileInfo);
         }
-        free(st);
-    }
-    if(fid)
-        npc_close(fid);
-    free(fn);
-    if(e) {
-        if(debug)
-            fprintf(stderr, "findfiles failed\n");
-        return e;
+        free(name);
+        if(err)
+            return err;
+        if((n->qid.type & Qtdir) && (omode & 3) != Oread)
+            return "is a directory";
+        if((omode & Otrunc) && !(n->qid.type & Qtdir)) {
+            lsetlen(n, 0);
+            n->qid.version++;
+        }
+        f->omode = omode & 3;
+        f->didx = 0;
+        f->doff = 0;
+        lputq(r, &n->qid);
+        lputn(r, 0, 4);
+        break;
+    case Lread:
+        off = lgetn(m, 8);
+        count = (u32)lgetn(m, 4);
+        if(m->bad)
+            return "bad message";
+        if(!f)
+            return "unknown fid";
+        if(f->omode < 0 || f->omode == Owrite)
+            return "fid not open for reading";
+        if(count > c->msize - IOHDRSZ)
+            count = c->msize - IOHDRSZ;
+        n = f->n;
+        if(n->qid.type & Qtdir) {
+            // entries are counted rather than held, as they may be
+            // removed between reads.
+            if(off == 0) {
+                f->didx = 0;
+                f->doff = 0;
+            } else if(off != f->doff) {
+                return "bad offset in directory read";
+            }
+            for(nn = n->kids, i = 0; nn && i < f->didx; i++)
+                nn = nn->sib;
+            cp = r->p;
+            lputn(r, 0, 4);
+            ep = r->e;
+            if(r->e - r->p > (int)count)
+                r->e = r->p + count;
+            for(; nn; nn = nn->sib) {
+                sp = r->p;
+                lputstat(r, nn);
+                if(r->bad) {
+                    r->p = sp;
+                    r->bad = 0;
+                    break;
+                }
+                f->didx++;
+                f->doff += r->p - sp;
+            }
+            r->e = ep;
+            putu32(cp, (u32)(r->p - cp - 4));
+        } else {
+            if(off >= n->len)
+                count = 0;
+            else if(count > n->len - off)
+                count = (u32)(n->len - off);
+            lputn(r, count, 4);
+            if(count) {
+                memcpy(r->p, n->data + off, count);
+                r->p += count;
+            }
+            n->atime = (u32)time(NULL);
+        }
+        break;
+    case Lwrite:
+        off = lgetn(m, 8);
+        count = (u32)lgetn(m, 4);
+        if(m->bad || (u32)(m->e - m->p) < count)
+            return "bad message";
+        if(!f)
+            return "unknown fid";
+        if(f->omode != Owrite && f->omode != Ordwr)
+            return "fid not open for writing";
+        n = f->n;
+        if(off + count > n->len && lsetlen(n, off + count) < 0)
+            return "file too big";
+        memcpy(n->data + off, m->p, count);
+        n->mtime = (u32)time(NULL);
+        n->qid.version++;
+        lputn(r, count, 4);
+        break;
+    case Lclunk:
+    case Lremove:
+        if(!f)
+            return "unknown fid";
+        n = f->n;
+        if(t == Lremove) {
+            if(!n->parent)
+                err = "permission denied";
+            else if(n->gone)
+                err = "file removed";
+            else if(n->kids)
+                err = "directory not empty";
+            else
+                lunlink(n);
+        }
+        lfreefid(c, f);
+        return err;
+    case Lstat:
+        if(!f)
+            return "unknown fid";
+        cp = r->p;
+        lputn(r, 0, 2);
+        lputstat(r, f->n);
+        if(!r->bad) {
+            cp[0] = (u8)(r->p - cp - 2);
+            cp[1] = (u8)((r->p - cp - 2) >> 8);
+        }
+        break;
+    case Lwstat:
+        lgetn(m, 2);
+        lgetn(m, 2);
+        lgetn(m, 2);
+        lgetn(m, 4);
+        lgetn(m, 13);
+        mode = (u32)lgetn(m, 4);
+        atime = (u32)lgetn(m, 4);
+        mtime = (u32)lgetn(m, 4);
+        len = lgetn(m, 8);
+        name = lgets(m);
+        for(i = 0; i < 3; i++)
+            free(lgets(m));
+        if(m->bad) {
+            free(name);
+            return "bad message";
+        }
+        n = f ? f->n : NULL;
+        if(!f)
+            err = "unknown fid";
+        else if(n->gone)
+            err = "file removed";
+        else if(name[0] && strcmp(name, n->name) != 0
+            && (!n->parent || strchr(name, '/') || lchild(n->parent, name)))
+            err = n->parent ? "file exists" : "permission denied";
+        else if(len != ~(u64)0 && (n->qid.type & Qtdir))
+            err = "is a directory";
+        else if(len != ~(u64)0 && len > LSFMAX)
+            err = "file too big";
+        if(!err && name[0] && strcmp(name, n->name) != 0) {
+            free(n->name);
+            n->name = name;
+            name = NULL;
+        }
+        free(name);
+        if(err)
+            return err;
+        if(len != ~(u64)0 && len != n->len) {
+            if(lsetlen(n, len) < 0)
+                return "out of memory";
+            n->qid.version++;
+        }
+        if(mode != ~(u32)0)
+            n->mode = (n->mode & Dmdir) | (mode & 0777);
+        if(atime != ~(u32)0)
+            n->atime = atime;
+        if(mtime != ~(u32)0)
+            n->mtime = mtime;
+        break;
+    default:
+        return "bad message";
     }
-    return 0;
+    return NULL;
 }
 
-static int
-_DeleteFile(
-    LPCWSTR             FileName,
-    PDOKAN_FILE_INFO    DokanFileInfo)
+static DWORD WINAPI
+lsConnProc(LPVOID arg)
 {
-    char *fn;
-    int r;
+    Lconn *c = arg;
+    u8 hdr[4], *in, *out;
+    u32 n, insz;
+    Lbuf m, r;
+    char *err;
+    int t, i;
 
-    if(debug)
-        fprintf(stderr, "deletefile %ws\n", FileName);
-    fn = p9path(FileName);
-    if(!fn)
-        return -(int)ERROR_NOT_ENOUGH_MEMORY;
-    r = npc_remove(fs, fn);
-    free(fn);
-    if(r < 0) {
-        if(debug)
-            fprintf(stderr, "deletefile %ws failed\n", FileName);
-        return cvtError();
+    in = NULL;
+    insz = 0;
+    out = malloc(LSMSIZE);
+    while(out) {
+        if(readn(c->s, hdr, 4) < 0)
+            break;
+        n = getu32(hdr);
+        if(n < 7 || n > LSMSIZE || grow(&in, &insz, n) < 0)
+            break;
+        if(readn(c->s, in, n - 4) < 0)
+            break;
+        t = in[0];
+        m.p = in + 3;
+        m.e = in + n - 4;
+        m.bad = 0;
+        r.p = out + 7;
+        r.e = out + c->msize;
+        r.bad = 0;
+        EnterCriticalSection(&lslk);
+        err = lrpc(c, t, &m, &r);
+        if(!err && r.bad)
+            err = "reply too big";
+        if(err) {
+            r.p = out + 7;
+            r.bad = 0;
+            lputs(&r, err);
+            t = Lerror;
+        }
+        LeaveCriticalSection(&lslk);
+        putu32(out, (u32)(r.p - out));
+        out[4] = (u8)(t + 1);
+        out[5] = in[1];
+        out[6] = in[2];
+        if(writen(c->s, out, (u32)(r.p - out)) < 0)
+            break;
     }
+    EnterCriticalSection(&lslk);
+    for(i = 0; i < NLSFID; i++)
+        while(c->fids[i])
+            lfreefid(c, c->fids[i]);
+    LeaveCriticalSection(&lslk);
+    closesocket(c->s);
+    free(in);
+    free(out);
+    free(c);
     return 0;
 }
 
-static int
-_DeleteDirectory(
-    LPCWSTR             FileName,
-    PDOKAN_FILE_INFO    DokanFileInfo)
+static DWORD WINAPI
+lsListenProc(LPVOID arg)
 {
-    return _DeleteFile(FileName, DokanFileInfo);
+    SOCKET l = (SOCKET)arg;
+    SOCKET a;
+    Lconn *c;
+    HANDLE h;
+    int one;
+
+    for(;;) {
+        a = accept(l, NULL, NULL);
+        if(a == INVALID_SOCKET) {
+            Sleep(100);
+            continue;
+        }
+        one = 1;
+        setsockopt(a, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof one);
+        c = calloc(1, sizeof *c);
+        h = NULL;
+        if(c) {
+            c->s = a;
+            c->msize = LSMSIZE;
+            h = CreateThread(NULL, 0, lsConnProc, c, 0, NULL);
+        }
+        if(h) {
+            CloseHandle(h);
+        } else {
+            closesocket(a);
+            free(c);
+        }
+    }
+    return 0;
 }
 
-static int
-_MoveFile(
-    LPCWSTR             FileName, // existing file name
-    LPCWSTR             NewFileName,
-    BOOL                ReplaceIfExisting,
-    PDOKAN_FILE_INFO    DokanFileInfo)
+// Start the loopback server and return its address.
+static char *
+lsStart(void)
 {
-    Npwstat st;
-    char *fn, *fn2, *p, *newname;
-    int dirlen, r, e;
+    static char addr[32];
+    struct sockaddr_in sin;
+    SOCKET l;
+    HANDLE h;
+    int len;
 
-    e = 0;
-    if(debug)
-        fprintf(stderr, "move %ws to %ws\n", FileName, NewFileName);
-    fn = p9path(FileName);
-    fn2 = p9path(NewFileName);
-    if(!fn || !fn2) {
-        e = -(int)ERROR_NOT_ENOUGH_MEMORY;
-        goto err;
+    InitializeCriticalSection(&lslk);
+    lsroot = lnode(NULL, "/", Dmdir | 0777);
+    if(!lsroot)
+        return NULL;
+    lsroot->ref = 1;
+    l = zlisten(INADDR_LOOPBACK, 0);
+    len = sizeof sin;
+    if(l == INVALID_SOCKET
+    || getsockname(l, (struct sockaddr *)&sin, &len) != 0
+    || (h = CreateThread(NULL, 0, lsListenProc, (LPVOID)l, 0, NULL)) == NULL) {
+        if(l != INVALID_SOCKET)
+            closesocket(l);
+        return NULL;
     }
+    CloseHandle(h);
+    sprintf(addr, "tcp!127.0.0.1!%d", ntohs(sin.sin_port));
+    return addr;
+}
 
-    p = strrchr(fn, '/');
-    if(p) {
-        dirlen = p - fn;
-        newname = fn2 + dirlen + 1;
-    } else {
-        dirlen = 0;
-        newname = fn2;
-    }
-    // same directory?
-    if(strncmp(fn, fn2, dirlen) != 0 || strchr(newname, '/') != NULL) {
-        // XXX better error?  cant move files between directories...
-        e = -(int)ERROR_NOT_SAME_DEVICE;
-        goto err;
-    }
+// Load test.  With -l, ninefs drives its own Dokan callbacks from
+// many threads instead of mounting a drive, against the server at
+// addr or, if none is given, the loopback server.  Each thread works
+// in its own directory of LDFILES files, picking operations at random
+// in proportion to the mix, and everything goes through the timed
+// wrappers so the statistics show what each kind of operation costs.
+// A leak shows up as fids still open once the files are removed, or
+// as memory still growing in the second half of the run, when the
+// tree and the cache have stopped growing; either fails the run.
+#define LDFILES     16
+#define LDMAXIO     (256 * 1024)
+#define LDSLOP      (2 * 1024 * 1024)
+#define LDMIX       "c1r4w2s4f2m1d1"
+#define LDNAME      64
 
-    npc_emptystat(&st);
-    st.name = newname;
-    r = npc_wstat(fs, fn, &st);
-    if(r < 0) {
-        e = cvtError();
-        goto err; 
-    }
-    /* fall through */
+typedef struct Ldr Ldr;
 
-err:
-    if(fn)
-        free(fn);
-    if(fn2)
-        free(fn2);
-    if(e) {
-        if(debug)
-            fprintf(stderr, "move failed\n");
-        return e;
-    }
-    return 0;
-}
+struct Ldr {
+    DOKAN_OPERATIONS *ops;
+    int id;
+    int *mix;
+    int total;
+    DWORD end;
+    u32 seed;
+    u8 *buf;
+};
 
-static int
-_LockFile(
-    LPCWSTR             FileName,
-    LONGLONG            ByteOffset,
-    LONGLONG            Length,
-    PDOKAN_FILE_INFO    DokanFileInfo)
+// Operations in a mix: create, read, write, stat, find, move, delete.
+static char ldops[] = "crwsfmd";
+static volatile LONG ldn = 0;
+
+static u32
+ldrand(Ldr *d, u32 n)
 {
-    // always fail; we dont do locking.
-    return -(int)ERROR_NOT_SUPPORTED;
+    d->seed = d->seed * 1103515245 + 12345;
+    return (d->seed >> 8) % n;
 }
 
-static int
-_SetEndOfFile(
-    LPCWSTR             FileName,
-    LONGLONG            ByteOffset,
-    PDOKAN_FILE_INFO    DokanFileInfo)
+static void
+ldname(Ldr *d, WCHAR *buf, int i)
 {
-    Npwstat st;
-    char *fn;
-    int r;
+    if(i < 0)
+        _snwprintf(buf, LDNAME, L"\\load\\t%d", d->id);
+    else
+        _snwprintf(buf, LDNAME, L"\\load\\t%d\\f%d", d->id, i);
+    buf[LDNAME - 1] = 0;
+}
 
-    fn = p9path(FileName);
-    if(!fn)
-        return -(int)ERROR_NOT_ENOUGH_MEMORY;
-    npc_emptystat(&st);
-    st.length = ByteOffset;
-    r = npc_wstat(fs, fn, &st);
-    free(fn);
-    if(r < 0)
-        return cvtError();
+static int WINAPI
+ldFill(PWIN32_FIND_DATAW fd, PDOKAN_FILE_INFO fi)
+{
     return 0;
 }
 
-static int
-_SetAllocationSize(
-    LPCWSTR             FileName,
-    LONGLONG            AllocSize,
-    PDOKAN_FILE_INFO    DokanFileInfo)
+// Close a handle the way Dokan does.
+static void
+ldClose(Ldr *d, WCHAR *name, PDOKAN_FILE_INFO fi)
 {
-    // XXX what exactly is this?
-    return notyet("SetAllocationSize");
+    d->ops->Cleanup(name, fi);
+    d->ops->CloseFile(name, fi);
 }
 
-static int
-_SetFileAttributes(
-    LPCWSTR             FileName,
-    DWORD               FileAttributes,
-    PDOKAN_FILE_INFO    DokanFileInfo)
+static void
+ldOp(Ldr *d, int op)
 {
-    if(debug)
-        fprintf(stderr, "setfileattributes '%ws' %x\n", FileName, FileAttributes);
-    FileAttributes &= ~FILE_ATTRIBUTE_NORMAL;
-    if(FileAttributes) {
-        if(debug)
-            fprintf(stderr, "setfileattributes error (unsupported bits)\n");
-        return -(int)ERROR_NOT_SUPPORTED;
+    DOKAN_OPERATIONS *o = d->ops;
+    DOKAN_FILE_INFO fi;
+    BY_HANDLE_FILE_INFORMATION bi;
+    WCHAR name[LDNAME], name2[LDNAME];
+    LONGLONG off;
+    DWORD n, got;
+
+    memset(&fi, 0, sizeof fi);
+    ldname(d, name, ldrand(d, LDFILES));
+    n = ldrand(d, LDMAXIO) + 1;
+    switch(op) {
+    case 'c':
+        if(o->CreateFile(name, GENERIC_WRITE, 0, CREATE_ALWAYS, 0, &fi) == 0) {
+            o->WriteFile(name, d->buf, n, &got, 0, &fi);
+            ldClose(d, name, &fi);
+        }
+        break;
+    case 'r':
+        if(o->CreateFile(name, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, 0, &fi) == 0) {
+            o->ReadFile(name, d->buf, n, &got, 0, &fi);
+            ldClose(d, name, &fi);
+        }
+        break;
+    case 'w':
+        off = ldrand(d, LDMAXIO);
+        if(o->CreateFile(name, GENERIC_WRITE, 0, OPEN_ALWAYS, 0, &fi) == 0) {
+            o->WriteFile(name, d->buf, n, &got, off, &fi);
+            if(ldrand(d, 4) == 0)
+                o->FlushFileBuffers(name, &fi);
+            ldClose(d, name, &fi);
+        }
+        break;
+    case 's':
+        if(o->CreateFile(name, FILE_READ_ATTRIBUTES, FILE_SHARE_READ, OPEN_EXISTING, 0, &fi) == 0) {
+            o->GetFileInformation(name, &bi, &fi);
+            ldClose(d, name, &fi);
+        }
+        break;
+    case 'f':
+        ldname(d, name, -1);
+        if(o->OpenDirectory(name, &fi) == 0) {
+            o->FindFiles(name, ldFill, &fi);
+            ldClose(d, name, &fi);
+        }
+        break;
+    case 'm':
+        ldname(d, name2, ldrand(d, LDFILES));
+        o->MoveFile(name, name2, TRUE, &fi);
+        break;
+    case 'd':
+        o->DeleteFile(name, &fi);
+        break;
     }
-    return 0;
 }
 
-
-static int
-_SetFileTime(
-    LPCWSTR             FileName,
-    CONST FILETIME*     CreationTime,
-    CONST FILETIME*     LastAccessTime,
-    CONST FILETIME*     LastWriteTime,
-    PDOKAN_FILE_INFO    DokanFileInfo)
+static DWORD WINAPI
+ldProc(LPVOID arg)
 {
-    Npwstat st;
-    char *fn;
-    int r;
+    Ldr *d = arg;
+    int i, w;
 
-    if(!LastAccessTime && !LastWriteTime)
-        return 0;
-    fn = p9path(FileName);
-    if(!fn)
-        return -(int)ERROR_NOT_ENOUGH_MEMORY;
-    npc_emptystat(&st);
-    if(LastAccessTime)
-        st.atime = fromFT(LastAccessTime);
-    if(LastWriteTime)
-        st.mtime = fromFT(LastWriteTime);
-    r = npc_wstat(fs, fn, &st);
-    free(fn);
-    if(r < 0)
-        return cvtError();
+    while((LONG)(GetTickCount() - d->end) < 0) {
+        w = ldrand(d, d->total);
+        for(i = 0; w >= d->mix[i]; i++)
+            w -= d->mix[i];
+        ldOp(d, ldops[i]);
+        InterlockedIncrement(&ldn);
+    }
     return 0;
 }
 
+// Run the load described by spec, threads,secs[,mix], through ops.
+// The mix is operation letters each followed by an optional weight.
+// Returns the exit status.
 static int
-_UnlockFile(
-    LPCWSTR             FileName,
-    LONGLONG            ByteOffset,
-    LONGLONG            Length,
-    PDOKAN_FILE_INFO    DokanFileInfo)
+loadRun(DOKAN_OPERATIONS *ops, char *spec)
 {
-    // always fail; we dont do locking.
-    return -(int)ERROR_NOT_SUPPORTED;
-}
+    DOKAN_FILE_INFO fi;
+    WCHAR name[LDNAME];
+    int mix[sizeof ldops - 1];
+    SIZE_T m1, m2;
+    LONG n1, n2;
+    DWORD t0, secs;
+    HANDLE *h;
+    Ldr *d;
+    char *p, *q;
+    int i, j, nthr, total, fail;
 
-static int
-_Unmount(
-    PDOKAN_FILE_INFO    DokanFileInfo)
-{
-    if(debug)
-        fprintf(stderr, "unmount\n");
-    npc_umount(fs);
-    fs = NULL;
-    return 0;
+    nthr = atoi(spec);
+    p = strchr(spec, ',');
+    secs = p ? atoi(p + 1) : 0;
+    p = p ? strchr(p + 1, ',') : NULL;
+    p = p ? p + 1 : LDMIX;
+    memset(mix, 0, sizeof mix);
+    while(*p && (q = strchr(ldops, *p)) != NULL) {
+        i = q - ldops;
+        if(isdigit((u8)p[1])) {
+            mix[i] = strtol(p + 1, &p, 10);
+        } else {
+            mix[i] = 1;
+            p++;
+        }
+    }
+    for(total = 0, i = 0; i < (int)ARRSZ(mix); i++)
+        total += mix[i];
+    if(nthr < 1 || secs < 1 || *p || total < 1) {
+        fprintf(stderr, "bad load %s\n", spec);
+        return 1;
+    }
+
+    d = calloc(nthr, sizeof *d);
+    h = calloc(nthr, sizeof *h);
+    if(!d || !h)
+        return 1;
+    memset(&fi, 0, sizeof fi);
+    ops->CreateDirectory(L"\\load", &fi);
+    t0 = GetTickCount();
+    for(i = 0; i < nthr; i++) {
+        d[i].ops = ops;
+        d[i].id = i;
+        d[i].mix = mix;
+        d[i].total = total;
+        d[i].end = t0 + secs * 1000;
+        d[i].seed = t0 + i * 7919;
+        d[i].buf = malloc(LDMAXIO);
+        if(!d[i].buf)
+            return 1;
+        memset(d[i].buf, 'a' + i % 26, LDMAXIO);
+        ldname(&d[i], name, -1);
+        ops->CreateDirectory(name, &fi);
+    }
+    fprintf(stderr, "load: %d threads for %lus\n", nthr, secs);
+    for(i = 0; i < nthr; i++) {
+        h[i] = CreateThread(NULL, 0, ldProc, &d[i], 0, NULL);
+        if(!h[i]) {
+            fprintf(stderr, "load: cannot start thread %d\n", i);
+            nthr = i;
+            break;
+        }
+    }
+    Sleep(secs * 500);
+    m1 = privBytes();
+    n1 = ldn;
+    for(i = 0; i < nthr; i++) {
+        WaitForSingleObject(h[i], INFINITE);
+        CloseHandle(h[i]);
+    }
+    m2 = privBytes();
+    n2 = ldn;
+    fprintf(stderr, "load: %ld ops in %.1fs, %.1f ops/s\n",
+        n2, (GetTickCount() - t0) / 1000.0, n2 * 1000.0 / (GetTickCount() - t0));
+    statsPrint();
+
+    fail = 0;
+    fprintf(stderr, "load: %+ldK private over the last %ld ops\n",
+        (long)(m2 - m1) / 1024, n2 - n1);
+    if((long)(m2 - m1) > LDSLOP) {
+        fprintf(stderr, "load: memory is still growing, %.0f bytes/op\n",
+            (double)(m2 - m1) / (n2 - n1 ? n2 - n1 : 1));
+        fail = 1;
+    }
+
+    for(i = 0; i < nthr; i++) {
+        for(j = 0; j < LDFILES; j++) {
+            ldname(&d[i], name, j);
+            _DeleteFile(name, &fi);
+        }
+        ldname(&d[i], name, -1);
+        _DeleteDirectory(name, &fi);
+        free(d[i].buf);
+    }
+    _DeleteDirectory(L"\\load", &fi);
+    free(d);
+    free(h);
+
+    // prefetching may still be listing what was removed.
+    for(i = 0; i < 50 && nfids > 0; i++)
+        Sleep(100);
+    if(nfids > 0) {
+        fprintf(stderr, "load: %ld fids still open\n", nfids);
+        fail = 1;
+    }
+    fprintf(stderr, "load: %s\n", fail ? "FAIL" : "ok");
+    return fail;
 }
 
 static void
 usage(char *prog)
 {
-    fprintf(stderr, "usage:  %s [-cdDtU] [-a authserv] [-p passwd] [-u user] addr driveletter\n", prog);
+    fprintf(stderr, "usage:  %s [-cdDtU] [-a authserv] [-C secs[,entries]] [-f policyfile] [-j jobs] [-m maxmsg] [-p passwd] [-P depth[,entries]] [-s secs] [-T threads] [-u user] [-w path] addr[!z] driveletter\n", prog);
+    fprintf(stderr, "        %s [-ds] -z port addr\n", prog);
+    fprintf(stderr, "        %s [options] -l threads,secs[,mix] [addr]\n", prog);
     fprintf(stderr, "\taddr and authserv must be of the form tcp!hostname!port\n");
     fprintf(stderr, "\t-c\tchatty npfs messages\n");
+    fprintf(stderr, "\t-C\tcache attributes and listings for secs seconds\n");
     fprintf(stderr, "\t-d\tninefs debug messages\n");
     fprintf(stderr, "\t-D\tDokan debug mesages\n");
+    fprintf(stderr, "\t-f\tread per-subtree cache and write policies from policyfile\n");
+    fprintf(stderr, "\t-j\tI/O engine threads, 0 to disable\n");
+    fprintf(stderr, "\t-l\trun a load test instead of mounting, against addr or a loopback server\n");
+    fprintf(stderr, "\t-m\tcap reads and writes at maxmsg bytes per 9p message\n");
+    fprintf(stderr, "\t-P\tprefetch subdirectory listings depth levels deep\n");
+    fprintf(stderr, "\t-s\tprint statistics every secs seconds\n");
     fprintf(stderr, "\t-t\tdo not perform path character translations\n");
+    fprintf(stderr, "\t-T\tnumber of Dokan threads\n");
     fprintf(stderr, "\t-U\tdisable 9p2000.u support\n");
+    fprintf(stderr, "\t-w\tload the metadata of the tree at path before mounting\n");
+    fprintf(stderr, "\t-z\trelay compressed connections on port to addr\n");
+    fprintf(stderr, "\taddr!z mounts through such a relay\n");
     _exit(1);
 }
 
@@ -807,19 +4564,28 @@ main(int argc, char **argv)
     DOKAN_OPERATIONS ops;
     DOKAN_OPTIONS opt;
     WSADATA wsData;
-    char *serv, *authserv, *passwd, *uname, *prog;
-    int x, ch, dotu;
+    char *serv, *authserv, *passwd, *uname, *prog, *warmpath, *polfile, *load, *p;
+    int x, ch, njobs, nthreads, zport;
+    Npcfsys *fs;
+    DWORD t0;
     char letter;
 
+    t0 = GetTickCount();
     WSAStartup(MAKEWORD(2,2), &wsData);
+    fgInit();
     memset(&opt, 0, sizeof opt);
 
     uname = "nobody";
     prog = argv[0];
-    dotu = 1;
+    njobs = 8;
+    nthreads = 0;
     authserv = NULL;
     passwd = NULL;
-    while((ch = getopt(argc, argv, "a:cdDp:tu:U")) != -1) {
+    warmpath = NULL;
+    polfile = NULL;
+    load = NULL;
+    zport = 0;
+    while((ch = getopt(argc, argv, "a:cC:dDf:j:l:m:p:P:s:tT:u:Uw:z:")) != -1) {
         switch(ch) {
         case 'a':
             authserv = optarg;
@@ -827,24 +4593,64 @@ main(int argc, char **argv)
         case 'c':
             npc_chatty = 1;
             break;
+        case 'C':
+            cachettl = atoi(optarg) * 1000;
+            if((p = strchr(optarg, ',')) != NULL) {
+                cachemax = atoi(p + 1);
+                if(cachemax < 1)
+                    usage(prog);
+                cachefixed = 1;
+            }
+            break;
         case 'd':
             debug = 1;
             break;
         case 'D':
             opt.Options |= DOKAN_OPTION_DEBUG | DOKAN_OPTION_STDERR;
             break;
+        case 'f':
+            polfile = optarg;
+            break;
+        case 'j':
+            njobs = atoi(optarg);
+            break;
+        case 'l':
+            load = optarg;
+            break;
+        case 'm':
+            maxmsg = strtoul(optarg, NULL, 0);
+            if(maxmsg <= IOHDRSZ)
+                usage(prog);
+            break;
         case 'p':
             passwd = optarg;
             break;
+        case 'P':
+            pfdepth = atoi(optarg);
+            if((p = strchr(optarg, ',')) != NULL)
+                pfbudget = atoi(p + 1);
+            break;
+        case 's':
+            statsecs = atoi(optarg);
+            break;
         case 't':
             transPath = 0;
             break;
+        case 'T':
+            nthreads = atoi(optarg);
+            break;
         case 'u':
             uname = optarg;
             break;
         case 'U':
             dotu = 0;
             break;
+        case 'w':
+            warmpath = optarg;
+            break;
+        case 'z':
+            zport = atoi(optarg);
+            break;
             
         default:
             usage(prog);
@@ -853,24 +4659,78 @@ main(int argc, char **argv)
     }
     argc -= optind;
     argv += optind;
-    if(argc != 2 || !argv[1][0])
-        usage(prog);
-    serv = argv[0];
-    letter = argv[1][0];
+    if(zport) {
+        Zrelay r;
+
+        if(argc != 1)
+            usage(prog);
+        if(zinit() < 0) {
+            fprintf(stderr, "compression not available\n");
+            return 1;
+        }
+        statsInit();
+        r.l = zlisten(INADDR_ANY, zport);
+        r.addr = argv[0];
+        r.client = 0;
+        if(r.l == INVALID_SOCKET) {
+            fprintf(stderr, "cannot listen on port %d\n", zport);
+            return 1;
+        }
+        zserve(&r);
+        return 0;
+    }
+    if(load) {
+        if(argc > 1)
+            usage(prog);
+        if(argc == 1) {
+            serv = argv[0];
+        } else if((serv = lsStart()) != NULL) {
+            dotu = 0;
+        } else {
+            fprintf(stderr, "cannot start loopback server\n");
+            return 1;
+        }
+        letter = 0;
+    } else {
+        if(argc != 2 || !argv[1][0])
+            usage(prog);
+        serv = argv[0];
+        letter = argv[1][0];
+    }
+    if(pfdepth > 0 && !cachettl)
+        cachettl = PFTTL;
+    if(warmpath && !cachettl)
+        cachettl = WARMTTL;
+    polInit(cachettl, pfdepth > 0);
+    if(polfile && loadPolicy(polfile) < 0)
+        return 1;
+
+    mntaddr = serv;
+    x = strlen(serv);
+    if(x > 2 && strcmp(serv + x - 2, "!z") == 0) {
+        serv[x - 2] = 0;
+        // addr names the relay, which does not speak to the auth server.
+        if(passwd && !authserv) {
+            fprintf(stderr, "-a authserv is needed with -p and !z\n");
+            return 1;
+        }
+        mntaddr = zclient(serv);
+        if(!mntaddr) {
+            fprintf(stderr, "cannot start compressed transport to %s\n", serv);
+            return 1;
+        }
+    }
 
     user = np_default_users->uname2user(np_default_users, uname);
     if(passwd) {
-        struct npcauth auth;
-
         if(!authserv)
             authserv = serv;
-        memset(&auth, 0, sizeof auth);
-        makeKey(passwd, auth.key);
-        auth.srv = npc_netaddr(authserv, 567);
-        fs = npc_netmount(npc_netaddr(serv, 564), dotu, user, 564, authp9any, &auth);
-    } else {
-        fs = npc_netmount(npc_netaddr(serv, 564), dotu, user, 564, NULL, NULL);
+        authaddr = authserv;
+        memset(&mntauth, 0, sizeof mntauth);
+        makeKey(passwd, mntauth.key);
     }
+    mnttimes = debug || statsecs;
+    fs = mountFs();
     if(!fs) {
         char *emsg;
         int eno;
@@ -879,8 +4739,25 @@ main(int argc, char **argv)
         fprintf(stderr, "failed to mount %s: (%d) %s\n", serv, eno, emsg);
         return 1;
     }
+    connInit(fs);
+
+    statsInit();
+    checkMsize();
+    cacheInit();
+    if(pfdepth > 0 || pfany) {
+        if(pfdepth <= 0)
+            pfdepth = PFDEPTH;
+        if(pfInit() < 0)
+            fprintf(stderr, "warning: cannot start prefetch\n");
+    }
+    if(njobs > 0 && engineInit(njobs) < 0)
+        fprintf(stderr, "warning: no I/O engine, transfers will be serial\n");
+    if(warmpath)
+        warm(warmpath);
+    if(mnttimes && !load)
+        fprintf(stderr, "ready to mount %c: after %lums\n", letter, GetTickCount() - t0);
 
-    opt.ThreadCount = 0;
+    opt.ThreadCount = nthreads;
     opt.DriveLetter = letter;
     //opt.Options |= DOKAN_OPTION_KEEP_ALIVE;
 
@@ -908,6 +4785,20 @@ main(int argc, char **argv)
     ops.GetDiskFreeSpace = NULL;
     ops.GetVolumeInformation = NULL;
     ops.Unmount = _Unmount;
+    if(statsecs || load) {
+        ops.CreateFile = sCreateFile;
+        ops.OpenDirectory = sOpenDirectory;
+        ops.Cleanup = sCleanup;
+        ops.ReadFile = sReadFile;
+        ops.WriteFile = sWriteFile;
+        ops.FlushFileBuffers = sFlushFileBuffers;
+        ops.GetFileInformation = sGetFileInformation;
+        ops.FindFiles = sFindFiles;
+        ops.DeleteFile = sDeleteFile;
+        ops.MoveFile = sMoveFile;
+    }
+    if(load)
+        return loadRun(&ops, load);
     x = DokanMain(&opt, &ops);
     if(x)
         fprintf(stderr, "error: %x\n", x);